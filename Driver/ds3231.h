@@ -3,17 +3,38 @@
 #include <linux/kernel.h>
 #include <linux/module.h>
 #include <linux/fs.h>
+#include <linux/cdev.h>
+#include <linux/kref.h>
+#include <linux/of.h>
 #include <linux/i2c.h>
 #include <linux/rtc.h>
 #include <linux/interrupt.h>
+#include <linux/gpio.h>
+#include <linux/poll.h>
+#include <linux/list.h>
+#include <linux/timerqueue.h>
+#include <linux/workqueue.h>
+#include <linux/pps_kernel.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+#include <linux/ktime.h>
+#include <linux/moduleparam.h>
 #include <linux/uaccess.h>
 #include <asm/errno.h>
 #include <asm/delay.h>
 #include <asm/atomic.h>
 
+#include "ds3231_ioctl.h"
+
 #define null 0
-#define LOCKED       0
-#define UNLOCKED     1
+
+/** Assigns <tt>x</tt> to <tt>y</tt> and returns it from the calling function if it is negative */
+#define RETURN_IF_LTZ(x, y) \
+    y = x;                  \
+    if (y < 0) {            \
+        return y;           \
+    }
 
 /**
  * @defgroup Registers
@@ -43,6 +64,7 @@
 #define DS3231_REG_DATE 0x04
 #define DS3231_REG_MONTH 0x05
 #define DS3231_REG_YEAR 0x06
+#define DS3231_NUM_TIME_REGS 7 /**< Number of consecutive time registers starting at <tt>DS3231_REG_SECONDS</tt> */
 /** @} */
 
 /**
@@ -71,6 +93,7 @@
 #define DS3231_REG_AGEINGOFFSET 0x10
 #define DS3231_REG_TEMPMSB 0x11
 #define DS3231_REG_TEMPLSB 0x12
+#define DS3231_NUM_REGS 0x13 /**< Size of the whole register file (<tt>DS3231_REG_SECONDS</tt> to <tt>DS3231_REG_TEMPLSB</tt>) */
 /** @} */
 
 
@@ -89,6 +112,7 @@
 #define DS3231_MASK_10_HOUR 0b00010000u
 #define DS3231_MASK_20_HOUR 0b00100000u
 #define DS3231_MASK_HOUR_SELECT 0b01000000u
+#define DS3231_MASK_DAY 0b00000111u
 #define DS3231_MASK_DATE 0b00001111u
 #define DS3231_MASK_10_DATE 0b00110000u
 #define DS3231_MASK_MONTH 0b00001111u
@@ -97,10 +121,18 @@
 #define DS3231_MASK_YEAR 0b00001111u
 #define DS3231_MASK_10_YEAR 0b11110000u
 #define DS3231_MASK_EOSC 0b10000000u
+#define DS3231_MASK_CONV 0b00100000u
+#define DS3231_MASK_RS2 0b00010000u
+#define DS3231_MASK_RS1 0b00001000u
 #define DS3231_MASK_INTCN 0b00000100u
 #define DS3231_MASK_A2IE 0b00000010u
 #define DS3231_MASK_A1IE 0b00000001u
+#define DS3231_MASK_ALARM_MATCH 0b10000000u
+#define DS3231_MASK_DY_DT 0b01000000u
 #define DS3231_MASK_OSF 0b10000000u
+#define DS3231_MASK_A2F 0b00000010u
+#define DS3231_MASK_A1F 0b00000001u
+#define DS3231_MASK_EN32KHZ 0b00001000u
 #define DS3231_MASK_BSY 0b00000100u
 /** @} */
 
@@ -110,30 +142,247 @@ typedef struct _ds3231_time
     u8 minute; /**< Minute part of the time (0-59) */
     u8 hour; /**< Hour part of the time (0-23) */
 
+    u8 weekday; /**< Day of the week (1-7, where 1 is Monday) */
     u8 month;  /**< Month part of the time (1-12) */
     u8 day;  /**< Day of the month part of the time (0-32) */
     u16 year;  /**< Year part of the time (2000-2199) */
 } ds3231_time_t;
 
+typedef struct _ds3231_alarm
+{
+    u8 second; /**< Second the alarm fires at (0-59, always 0 for alarm 2) */
+    u8 minute; /**< Minute the alarm fires at (0-59) */
+    u8 hour; /**< Hour the alarm fires at (0-23) */
+    u8 day; /**< Day of the month the alarm fires at (1-31) */
+    u8 enabled; /**< Set to 1 if the alarm raises an interrupt when it fires */
+    u8 pending; /**< Set to 1 if the alarm fired and was not yet acknowledged */
+} ds3231_alarm_t;
+
+/** Number of samples kept by the temperature sampler */
+#define DS3231_TEMP_HISTORY 256
+
+/** A sample of the temperature sampler (see <tt>ds3231_temp_init(void)</tt>) */
+typedef struct ds3231_ioc_temp_sample ds3231_temp_sample_t;
+
+/**
+ * @addtogroup Operations
+ * Operations on the chip whose latency is traced and recorded (see <tt>ds3231_op_begin</tt>).
+ *
+ * @{
+ */
+#define DS3231_OP_PROBE 0
+#define DS3231_OP_READ_TIME 1
+#define DS3231_OP_WRITE_TIME 2
+#define DS3231_OP_READ_STATUS 3
+#define DS3231_OP_READ_SNAPSHOT 4
+#define DS3231_OP_READ_TEMP 5
+#define DS3231_OP_GET_TIME 6
+#define DS3231_NUM_OPS 7
+/** @} */
+
+/** Number of log2 latency buckets: bucket <tt>n</tt> counts latencies from <tt>2^n</tt> up to <tt>2^(n+1)</tt> µs, the last one everything above */
+#define DS3231_LAT_BUCKETS 20
+
+/** Latency statistics of one operation on the chip */
+typedef struct _ds3231_op_stats
+{
+    u32 count; /**< Number of times the operation completed */
+    u32 errors; /**< Number of times the operation failed */
+    u64 total_ns; /**< Sum of all latencies in nanoseconds */
+    u64 max_ns; /**< Highest latency in nanoseconds */
+    u32 hist[DS3231_LAT_BUCKETS]; /**< Log2 histogram of the latencies */
+} ds3231_op_stats_t;
+
+struct _ds3231_status;
+struct _ds3231_emul;
+
+/** Register access of a chip, either over I2C or to the emulated register model (see <tt>ds3231_emul_attach</tt>) */
+typedef struct _ds3231_bus_ops
+{
+    int (*read_regs)(struct _ds3231_status *chip, u8 reg, u8 len, u8 *buf); /**< Reads <tt>len</tt> consecutive registers starting at <tt>reg</tt> */
+    int (*write_regs)(struct _ds3231_status *chip, u8 reg, u8 len, const u8 *buf); /**< Writes <tt>len</tt> consecutive registers starting at <tt>reg</tt> */
+    bool (*atomic_read)(struct _ds3231_status *chip); /**< Returns true if a multi-register read latches all registers at once */
+    int (*recover)(struct _ds3231_status *chip); /**< Frees a stuck bus (<tt>null</tt> if the bus cannot get stuck) */
+} ds3231_bus_ops_t;
+
+/**
+ * @addtogroup Health
+ * States of the bus health of a chip (see <tt>ds3231_health_xfer</tt>).
+ *
+ * @{
+ */
+#define DS3231_HEALTH_OK 0 /**< Recent transfers succeeded on the first attempt */
+#define DS3231_HEALTH_DEGRADED 1 /**< Recent transfers needed retries */
+#define DS3231_HEALTH_RECOVERING 2 /**< A transfer failed after all retries; reads are answered with the extrapolated time */
+/** @} */
+
+/** Maximum number of chips (and character device minors) the driver serves */
+#define DS3231_MAX_CHIPS 8
+
+/**
+ * State of one DS3231 chip. Allocated in probe for every chip the driver binds to and
+ * reference counted, so open file handles keep it alive after the chip was removed.
+ */
 typedef struct _ds3231_status
 {
+    struct i2c_client *client; /**< The I2C client for interfacing with the chip */
+    const ds3231_bus_ops_t *bus; /**< Register access of the chip (I2C or the emulated register model) */
+    struct _ds3231_emul *emul; /**< The emulated register model or <tt>null</tt> if the chip is real */
+    struct kref ref; /**< References held by the I2C device and by open file handles */
+    u8 removed; /**< Set to 1 once the I2C device was removed; bus accesses fail with <tt>-ENODEV</tt> and no work is queued afterwards */
+    u8 work_ready; /**< Set to 1 once the work items of the temperature sampler and the calibration are initialized */
+    int minor; /**< Minor number of the character device of the chip */
+    struct cdev *cdev; /**< Character device of the chip */
     u8 rtc_busy; /**< Busy flag of the real-time-clock chip (updated on every read/write operation) */
-    atomic_t drv_busy; /**< Busy flag of the driver. Set whenever the driver is interacted with (except on <tt>open()</tt> and <tt>close()</tt>) */
+    struct mutex lock; /**< Serializes all access to the chip and the fields of this object. Contenders sleep until it is released. */
     u8 osf;  /**< Oscillator stop flag of the real-time-clock chip (updated on every read/write operation) */
-    s8 temp;  /**< Temperature of the real-time-clock chip (updated on every read/write operation) */
+    s16 temp;  /**< Temperature of the real-time-clock chip in 1/4 °C steps (updated on every read/write operation) */
+    s8 aging; /**< Aging offset register of the real-time-clock chip (updated on every read operation) */
     u8 drv_temp_test; /**< Set to 1 to disable temperature polling from the RTD*/
+    struct rtc_device *rtc; /**< The device registered with the kernel's RTC class */
+    int irq; /**< Interrupt of the INT/SQW pin or <tt>0</tt> if it is not connected */
+    u8 sqw; /**< Set to 1 if INT/SQW outputs the 1 Hz square wave and to 0 if it signals alarms */
+    u8 ticking; /**< Set to 1 if square wave edges are delivered through <tt>irq</tt> */
+    u32 tick; /**< Number of 1 Hz square wave edges seen since the interrupt was set up */
+    ktime_t tick_time; /**< Monotonic time of the last square wave edge (written under <tt>page_lock</tt>, read through <tt>ds3231_tick_time</tt>) */
+    wait_queue_head_t tick_wait; /**< Waiters for the next square wave edge */
+    struct pps_device *pps; /**< PPS source fed by the square wave or <tt>null</tt> */
+    u8 alarm_enabled; /**< Interrupt enable bits (<tt>DS3231_MASK_A1IE</tt>, <tt>DS3231_MASK_A2IE</tt>) of the alarms */
+    u32 alarm_events[2]; /**< Number of times alarm 1 and alarm 2 fired */
+    wait_queue_head_t alarm_wait; /**< Waiters for an alarm to fire or a timer to expire */
+    struct timerqueue_head timers; /**< Pending timers of all file handles, ordered by deadline (see <tt>ds3231_timer_add</tt>) */
+    u8 timers_armed; /**< Set to 1 while alarm 1 is owned by the timer queue */
+
+    u8 temp_sampling; /**< Set to 1 while the temperature sampler owns <tt>temp</tt> */
+    struct delayed_work temp_work; /**< Work item of the temperature sampler */
+    spinlock_t temp_lock; /**< Protects the <tt>temp_history</tt> ring buffer */
+    ds3231_temp_sample_t temp_history[DS3231_TEMP_HISTORY]; /**< Ring buffer of temperature samples */
+    unsigned int temp_head; /**< Index the next sample is written to */
+    unsigned int temp_count; /**< Number of valid samples in <tt>temp_history</tt> */
+
+    struct delayed_work conv_work; /**< Work item checking for the end of a forced conversion */
+    wait_queue_head_t conv_wait; /**< Waiters for a forced conversion to finish */
+    u8 conv_running; /**< Set to 1 while a forced conversion is running */
+    u8 conv_deferred; /**< Set to 1 while a forced conversion waits for the chip's own conversion (BSY) to finish before setting CONV */
+    u32 conv_seq; /**< Number of forced conversions started */
+    u32 conv_done; /**< Value of <tt>conv_seq</tt> of the last finished conversion */
+    ktime_t conv_start; /**< Monotonic time the running conversion was started at */
+    int conv_result; /**< Result of the last finished conversion */
+    s16 conv_temp; /**< Temperature measured by the last successful conversion in 1/4 °C steps */
+
+    struct delayed_work calib_work; /**< Work item of the aging offset calibration */
+    u8 calib_state; /**< One of the <tt>DS3231_CALIB_*</tt> states */
+    u32 calib_writes; /**< Value of <tt>time_writes</tt> when the current window started */
+    s64 calib_start_ns; /**< <tt>CLOCK_REALTIME</tt> of the square wave edge the current window started at */
+    s64 calib_start_offset; /**< Offset of <tt>CLOCK_REALTIME</tt> against the RTC at the start of the window */
+    s64 calib_last_ns; /**< <tt>CLOCK_REALTIME</tt> of the last measurement */
+    s64 calib_last_offset; /**< Offset of <tt>CLOCK_REALTIME</tt> against the RTC at the last measurement */
+    s32 calib_drift_ppb; /**< Last estimate of the frequency error of the RTC (positive if it runs fast) */
+    u8 calib_valid; /**< Set to 1 if <tt>calib_drift_ppb</tt> holds an estimate */
+    u32 calib_adjustments; /**< Number of times the aging offset was adjusted */
+    u8 cache_valid; /**< Set to 1 if <tt>cache_secs</tt> and <tt>cache_anchor</tt> may be used to answer reads */
+    time64_t cache_secs; /**< RTC time of the cache anchor in seconds since the epoch */
+    ktime_t cache_anchor; /**< Monotonic time at which the RTC entered <tt>cache_secs</tt> (an upper bound) */
+    ktime_t cache_floor; /**< Monotonic time before which the RTC cannot have entered <tt>cache_secs</tt> */
+    u32 time_writes; /**< Number of times the time registers were written */
+
+    spinlock_t read_lock; /**< Protects the <tt>read_*</tt> fields below */
+    wait_queue_head_t read_wait; /**< Readers waiting for the result of the read in flight */
+    u8 read_in_flight; /**< Set while one reader accesses the RTC on behalf of all concurrent readers */
+    u32 read_seq; /**< Incremented every time a read in flight completes */
+    int read_result; /**< Return value of the last completed read */
+    ds3231_time_t read_time; /**< Time returned by the last successful read */
+
+    spinlock_t stats_lock; /**< Protects <tt>stats</tt> and <tt>busy_rejections</tt> */
+    ds3231_op_stats_t stats[DS3231_NUM_OPS]; /**< Latency statistics, indexed by <tt>DS3231_OP_*</tt> */
+    u32 busy_rejections; /**< Number of requests rejected with <tt>-EBUSY</tt> */
+    u32 health_retries; /**< Number of retried register transfers (protected by <tt>stats_lock</tt>) */
+    u32 health_recoveries; /**< Number of successful bus recoveries (protected by <tt>stats_lock</tt>) */
+    u32 health_failures; /**< Number of register transfers that failed after all retries (protected by <tt>stats_lock</tt>) */
+    u32 health_stale_reads; /**< Number of reads answered with the extrapolated time while recovering (protected by <tt>stats_lock</tt>) */
+    u8 health; /**< One of the <tt>DS3231_HEALTH_*</tt> states (updated under <tt>lock</tt>) */
+    u32 health_streak; /**< Number of consecutive clean transfers while degraded */
+    ktime_t health_last_ok; /**< Monotonic time of the last successful register transfer */
+    struct dentry *debugfs; /**< Directory of the chip in debugfs or <tt>null</tt> */
+
+    struct ds3231_time_page *page; /**< Page shared read-only with userspace (see <tt>ds3231_page_mmap</tt>) */
+    spinlock_t page_lock; /**< Serializes updates of <tt>page</tt> from process and interrupt context */
+    s64 page_read_start; /**< Monotonic time the read the page's anchor comes from started at (protected by <tt>page_lock</tt>) */
+    s64 page_floor; /**< Monotonic time before which the RTC cannot have entered the page's seconds (protected by <tt>page_lock</tt>) */
 } ds3231_status_t;
 
-extern ds3231_status_t ds3231_status;
+/** Longest input accepted by <tt>ds3231_io_write_iter</tt>; all forms (and a trailing newline) fit */
+#define DS3231_WRITE_MAX 32
+
+/** Per-open state of the character device (stored in <tt>file->private_data</tt>) */
+typedef struct _ds3231_file
+{
+    ds3231_status_t *chip; /**< The chip this file handle was opened on (holds a reference) */
+    struct mutex lock; /**< Serializes reads on the same file handle */
+    char buf[48]; /**< Time rendered on the first read of this file handle */
+    size_t len; /**< Number of valid bytes in <tt>buf</tt> (0 until the first read) */
+    u32 tick; /**< Value of <tt>chip->tick</tt> when <tt>buf</tt> was rendered */
+    struct list_head timers; /**< Pending timers registered through this file handle */
+    struct list_head expired; /**< Expired timers not yet collected with <tt>DS3231_IOC_RD_EXPIRED</tt> */
+    unsigned int num_timers; /**< Number of entries in <tt>timers</tt> */
+    u32 conv_seq; /**< Forced conversion requested through this file handle (<tt>0</tt> if none) */
+
+    wait_queue_head_t async_wait; /**< Woken when a render or write submitted by a non-blocking call finished */
+    struct work_struct read_work; /**< Renders the time for non-blocking reads (see <tt>ds3231_io_read_iter</tt>) */
+    u8 read_pending; /**< Set to 1 while <tt>read_work</tt> is queued or running (protected by <tt>lock</tt>) */
+    u8 read_fresh; /**< Set to 1 by <tt>read_work</tt> after it rendered a text the next read starts at (protected by <tt>lock</tt>) */
+    int read_error; /**< Error of the last failed render of <tt>read_work</tt>, returned by the next read (protected by <tt>lock</tt>) */
+    spinlock_t async_lock; /**< Protects the <tt>write_*</tt> fields below */
+    struct work_struct write_work; /**< Applies writes submitted by non-blocking writers (see <tt>ds3231_io_write_iter</tt>) */
+    u8 write_pending; /**< Set to 1 while <tt>write_work</tt> is queued or running */
+    int write_cmd; /**< Parsed command of the submitted write */
+    ds3231_time_t write_time; /**< Parsed time of the submitted write */
+    int write_error; /**< Error of the last applied write until it was reported (<tt>0</tt> if none) */
+} ds3231_file_t;
+
+/** A timer multiplexed onto alarm 1 (see <tt>ds3231_timer_add</tt>) */
+typedef struct _ds3231_timer
+{
+    struct timerqueue_node node; /**< Entry in <tt>chip->timers</tt>, keyed on the RTC time of the deadline */
+    struct list_head file_entry; /**< Entry in the <tt>timers</tt> or <tt>expired</tt> list of the owner */
+    ds3231_file_t *owner; /**< The file handle the timer was registered through */
+    u64 cookie; /**< Value handed back to the owner when the timer expires */
+} ds3231_timer_t;
+
+/** Decoded value of every BCD byte (see <tt>ds3231_bcd2bin</tt>) */
+extern const u8 ds3231_bcd_to_bin[256];
+
+/** BCD encoding of the values <tt>0</tt> to <tt>99</tt> (see <tt>ds3231_bin2bcd</tt>) */
+extern const u8 ds3231_bin_to_bcd[100];
+
+/**
+ * Converts a BCD byte to binary with a table lookup. Nibbles above 9 are weighted like the
+ * arithmetic conversion, so the result matches <tt>bcd2bin</tt> for every byte.
+ */
+static inline u8 ds3231_bcd2bin(u8 bcd)
+{
+    return ds3231_bcd_to_bin[bcd];
+}
+
+/** Converts a value from <tt>0</tt> to <tt>99</tt> to BCD with a table lookup */
+static inline u8 ds3231_bin2bcd(u8 val)
+{
+    return ds3231_bin_to_bcd[val];
+}
+
+/** Format string and arguments for printing a temperature given in 1/4 °C steps */
+#define DS3231_TEMP_FMT "%s%d.%02d"
+#define DS3231_TEMP_ARG(t) ((t) < 0 ? "-" : ""), abs(t) / 4, (abs(t) % 4) * 25
 
 /**
- * Opens a connection to the I2C bus for communicating with the DS3231 RTC.
- * Connects to the RTC with address <tt>0x68</tt> on the I2C bus of the system
- * and creates a new I2C adapter and device. Also registers as an I2C driver.
+ * Registers as an I2C driver, which binds to all DS3231 chips described by the device
+ * tree or ACPI. Unless the <tt>i2c_bus</tt> module parameter is <tt>-1</tt> or the device
+ * tree describes a chip, also instantiates a chip with address <tt>0x68</tt> on that I2C bus.
+ * A missing bus or an occupied address only causes a warning.
  *
  * @brief Initializes the I2C driver.
- * @return <tt>0</tt> on success and either <tt>-ENODEV</tt> or the return
- * value of <tt>i2c_add_driver(i2c_driver*)</tt> on failure.
+ * @return <tt>0</tt> on success and the return value of
+ * <tt>i2c_add_driver(i2c_driver*)</tt> on failure.
  *
  * @see i2c_add_driver(i2c_driver*)
  * @ingroup Initialization
@@ -147,9 +396,16 @@ int ds3231_hw_init(void);
 void ds3231_hw_exit(void);
 
 /**
- * Creates and registers the linux character driver for the ds3231 real-time-clock.
- * The driver will be created with the name <tt>ds3231_drv</tt> and will allocate
- * only <tt>1</tt> minor number for the character device.
+ * Drops a reference to the state of a chip and frees it once the last one is gone.
+ *
+ * @param[in] chip The chip to release
+ */
+void ds3231_chip_put(ds3231_status_t *chip);
+
+/**
+ * Registers the linux character driver for the ds3231 real-time-clock. The driver
+ * allocates <tt>DS3231_MAX_CHIPS</tt> minor numbers under the name <tt>ds3231_drv</tt>;
+ * the character devices themselves are added per chip by <tt>ds3231_io_add</tt>.
  *
  * @return <tt>0</tt> on success and a kernel error code on failure. Should <tt>alloc_chrdev_region</tt> fail
  * it's return value will be returned. Otherwise <tt>-EIO</tt> will be returned.
@@ -169,21 +425,50 @@ int ds3231_io_init(void);
 void ds3231_io_exit(void);
 
 /**
- * Configures the real-time-clock for driver usage by <ol><li>Disabling interrupts
- * and alarms</li><li>Re-enabling the oscillator and</li><li>setting the RTC to
+ * Adds the character device of a chip on the next free minor number. The first chip
+ * shows up as <tt>/dev/ds3231_drv</tt>, further chips as <tt>/dev/ds3231_drvN</tt>.
+ *
+ * @param[in] chip The chip to add the character device for
+ * @return <tt>0</tt> on success, <tt>-ENOSPC</tt> if all minors are in use and a kernel
+ * error code on failure.
+ */
+int ds3231_io_add(ds3231_status_t *chip);
+
+/**
+ * Removes the character device of a chip. File handles that are still open keep working
+ * on the chip state, but fail once the chip touches the bus.
+ *
+ * @param[in] chip The chip to remove the character device of
+ */
+void ds3231_io_remove(ds3231_status_t *chip);
+
+/**
+ * Calls <tt>fn</tt> for every chip that has a character device. The chips cannot be removed
+ * meanwhile, but <tt>fn</tt> must not add or remove character devices itself.
+ *
+ * @param[in] fn The function to call with each chip
+ */
+void ds3231_io_for_each_chip(void (*fn)(ds3231_status_t *chip));
+
+/**
+ * Configures the real-time-clock for driver usage by <ol><li>Disabling alarms and
+ * routing either the 1 Hz square wave or the alarm interrupts to the INT/SQW pin</li><li>Re-enabling the oscillator and</li><li>setting the RTC to
  * 24hr mode</li></ol>
- * This method is called by the linux kernel.
+ * Afterwards the state of the chip is allocated, the RTC is registered with the RTC class, the
+ * square wave interrupt is set up and the chip gets its own character device.
+ * This method is called by the linux kernel for every chip the driver binds to.
  *
  * @brief Sets up the real-time-clock.
  * @param[in] client The I2C client for communicating with the RTC
  * @param[in] id The device id of the RTC (unused)
- * @return <tt>0</tt> on success and <tt>-ENODEV</tt> on failure.
+ * @return <tt>0</tt> on success and <tt>-ENODEV</tt> or <tt>-ENOMEM</tt> on failure.
  */
 int ds3231_hw_probe(struct i2c_client *client, const struct i2c_device_id *id);
 
 /**
- * Does nothing except write a debug message to the kernel log, just here
- * for completeness.
+ * Removes the character device of the chip, stops its background work and shuts down the
+ * square wave interrupt and PPS source (see <tt>ds3231_irq_exit</tt>). Everything else is
+ * released automatically; the state of the chip lives on until the last file handle is closed.
  * This method is called by the linux kernel.
  *
  * @param[in] client The I2C client being removed
@@ -192,20 +477,18 @@ int ds3231_hw_probe(struct i2c_client *client, const struct i2c_device_id *id);
 int ds3231_hw_remove(struct i2c_client *client);
 
 /**
- * Does nothing except write a debug message to the kernel log, just here
- * for completeness.
+ * Allocates the per-open state (<tt>ds3231_file_t</tt>) of the file handle.
  * This method is called by the linux kernel.
  *
  * @param[in] inode The linux VFS inode for file-system access
  * @param[in] file The file handle to store specific data and provide information
  * on how that file was opened.
- * @return <tt>0</tt>. This function never fails
+ * @return <tt>0</tt> on success and <tt>-ENOMEM</tt> if the per-open state could not be allocated.
  */
 int ds3231_io_open(struct inode *inode, struct file *file);
 
 /**
- * Does nothing except write a debug message to the kernel log, just here
- * for completeness.
+ * Frees the per-open state of the file handle.
  * This method is called by the linux kernel.
  *
  * @param[in] inode The linux VFS inode for file-system access
@@ -218,44 +501,60 @@ int ds3231_io_close(struct inode *inode, struct file *file);
 /**
  * Reads time and status from the RTC chip and writes it to a user-controlled character
  * device. It will be written to the character device in the format <tt>DD. M HH:MM:SS YYYY</tt>
- * where <tt>M</tt> refers to the full month name in German (see <tt>MONTH_NAMES</tt>).
- * Returns a kernel error code if either the Driver is already busy or the reading
- * from the chip fails.
+ * followed by a newline, where <tt>M</tt> refers to the full month name in German (see <tt>MONTH_NAMES</tt>).
+ * The RTC is only accessed on the first read of an open file handle; the rendered text is kept
+ * in the per-open buffer and served from there, honouring <tt>offset</tt>, until the end is reached.
+ * If the square wave interrupt is available and the RTC's second changed after the text was fully
+ * read, the next read renders the new time from the start.
+ * Returns a kernel error code if the reading from the chip fails.
+ *
+ * With <tt>O_NONBLOCK</tt> the caller never waits: the chip is read by a work item and the read
+ * returns <tt>-EAGAIN</tt> until the text is rendered, which <tt>poll()</tt> signals with
+ * <tt>POLLIN</tt>. A failed render is returned by the next read.
  *
  * This method is called by the linux kernel.
  *
  * @brief Reads time and status from chip and writes  it to a user-controlled character device.
- * @param[in] file Struct that contains information about the caller and the type of call
- * @param[out] buffer Memory in userspace the data is to be written
- * @param[in] bytes number of bytes to be read
- * @param[in] offset offset inside the file or device
- * @return <ul><li><tt>-EBUSY</tt> if the driver is currently busy,</li><li><tt>-EAGAIN</tt> if the RTC's
- * oscillator was stopped (see <tt>ds3231_read_status(void)</tt>),</li><li>If there was
- * an error writing to the RTC <tt>-ENODEV</tt> is returned.</li></ul>otherwise the number of bytes left uncopied.
+ * @param[in,out] iocb The request, with the file handle and the offset inside the file, which is advanced by the number of bytes read
+ * @param[out] to Memory in userspace the data is to be written to
+ * @return <ul><li><tt>-ERESTARTSYS</tt> if interrupted while waiting for the bus,</li><li><tt>-EAGAIN</tt> if the RTC's
+ * oscillator was stopped (see <tt>ds3231_read_status(void)</tt>),</li><li><tt>-EFAULT</tt> if the data could not be
+ * copied to userspace,</li><li>If there was an error reading from the RTC <tt>-ENODEV</tt> is returned.</li></ul>
+ * otherwise the number of bytes read, which is <tt>0</tt> once the end of the rendered time was reached.
  *
  * @see MONTH_NAMES
  * @see ds3231_read_status(void)
- * @see ds3231_read_time(ds3231_time_t*)
+ * @see ds3231_get_time(ds3231_time_t*)
  */
-ssize_t ds3231_io_read(struct file *file, char __user *buffer, size_t bytes, loff_t *offset);
+ssize_t ds3231_io_read_iter(struct kiocb *iocb, struct iov_iter *to);
 
 /**
  * Reads a time or temperature from userspace and writes it to the RTC-Chip.
- * Returns a kernel error code if either the driver is already busy, the
- * oscillator of the RTC stopped, the time provided is in a wrong format or
- * writing the time to the RTC failed.
+ * The time is accepted as <tt>YYYY-MM-DD hh:mm:ss</tt>, as <tt>@</tt> followed by the seconds
+ * since the epoch (both optionally followed by a newline) or as a <tt>struct ds3231_time_record</tt>;
+ * <tt>sync</tt> sets the RTC to the system time at the next second boundary (see <tt>ds3231_sync_time</tt>);
+ * <tt>$</tt> followed by degrees overrides the temperature. At most <tt>DS3231_WRITE_MAX</tt> bytes
+ * are copied to a fixed buffer on the stack and parsed in a single pass.
+ * Returns a kernel error code if either the oscillator of the RTC stopped,
+ * the time provided is in a wrong format or writing the time to the RTC failed.
+ * Sleeps until all earlier users of the I2C bus are done.
+ *
+ * With <tt>O_NONBLOCK</tt> the input is parsed right away and applied to the chip by a work item;
+ * the write returns the number of bytes once it is accepted and <tt>poll()</tt> reports
+ * <tt>POLLOUT</tt> once it was applied. Further writes get <tt>-EAGAIN</tt> meanwhile. If applying
+ * failed, <tt>poll()</tt> reports <tt>POLLERR</tt> and the next write (which is dropped) or
+ * <tt>DS3231_IOC_RD_WRITE_RESULT</tt> returns the error.
  *
  * This method is called by the linux kernel.
  *
  * @brief Reads a time or temperature from userspace and writes it to the RTC-Chip.
- * @param[in] file Struct that contains information about the caller and the type of call
- * @param[in] buffer Space in userspace the data is read from
- * @param[in] bytes number of bytes to be written
- * @param[in] offset offset inside the file or device
- * @return <ul><li><tt>-EBUSY</tt> if the driver is currently busy,</li><li><tt>-ENOEXEC</tt> if
- * the format of the provided string is incorrect,</li><li><tt>-EAGAIN</tt> if the RTC's
+ * @param[in] iocb The request, with the file handle
+ * @param[in] from Space in userspace the data is read from
+ * @return <ul><li><tt>-ERESTARTSYS</tt> if interrupted while waiting for the bus,</li><li><tt>-ENOEXEC</tt> if
+ * the format of the provided string is incorrect or its fields are out of range (ie. 78 seconds),</li><li><tt>-EAGAIN</tt> if the RTC's
  * oscillator was stopped (see <tt>ds3231_read_status(void)</tt>),
- * </li><li><tt>-EINVAL</tt> if the fields of the input are out of range (ie. 78 seconds),
+ * </li><li><tt>-EINVAL</tt> if the input is empty or longer than <tt>DS3231_WRITE_MAX</tt> bytes,
+ * </li><li><tt>-EFAULT</tt> if the input could not be copied from userspace,
  * </li><li><tt>-EOVERFLOW</tt> if the provided date is before the year 2000 or after the
  * year 2199.</li><li>If there was an error writing to the RTC <tt>-ENODEV</tt> is returned.</li></ul>
  * Otherwise the number of bytes processed is returned.
@@ -263,50 +562,740 @@ ssize_t ds3231_io_read(struct file *file, char __user *buffer, size_t bytes, lof
  * @see ds3231_read_status(void)
  * @see ds3231_write_time(ds3231_time_t*)
  */
-ssize_t ds3231_io_write(struct file *file, const char __user *buffer, size_t bytes, loff_t *offset);
+ssize_t ds3231_io_write_iter(struct kiocb *iocb, struct iov_iter *from);
 
 
 /**
  * Writes the time stored in the parameter to the DS3231 RTC chip via the I2C bus.
  * It first converts the given decimal representation of the time into DS3231-readable
  * time according to the <tt>Timekeeping Registers</tt> on page 11 of the DS3231 manual.
- * It then writes these converted values to the DS3231 using the I2C bus. Years are written beginning
- * from <tt>0</tt> where <tt>0</tt> refers to the year <tt>2000</tt>.
+ * The day of the week is derived from the date and stored in <tt>time->weekday</tt>.
+ * It then writes all seven time registers to the DS3231 in a single block transfer, so
+ * the chip never holds a mix of old and new time. Years are written beginning from
+ * <tt>0</tt> where <tt>0</tt> refers to the year <tt>2000</tt>.
  *
- * @param[in] time The time to write to the RTC
- * @return <tt>0</tt> on success and a kernel error code (returned by <tt>i2c_smbus_write_byte_data</tt>)
- * on failure.
+ * @param[in] chip The chip to operate on
+ * @param[in,out] time The time to write to the RTC
+ * @return <tt>0</tt> on success and a kernel error code (returned by <tt>i2c_smbus_write_i2c_block_data</tt>
+ * or <tt>i2c_smbus_write_byte_data</tt>) on failure.
+ *
+ * @see i2c_smbus_write_i2c_block_data(i2c_client*, u8, u8, const u8*)
+ */
+int ds3231_write_time(ds3231_status_t *chip, ds3231_time_t *time);
+
+/**
+ * Writes time registers encoded with <tt>ds3231_encode_time</tt> to the DS3231 RTC chip in a
+ * single block transfer. Writing the seconds register restarts the chip's current second.
+ *
+ * @param[in] chip The chip to operate on
+ * @param[in] regs The <tt>DS3231_NUM_TIME_REGS</tt> time registers
+ * @return <tt>0</tt> on success and a kernel error code on failure.
+ */
+int ds3231_write_time_regs(ds3231_status_t *chip, const u8 *regs);
+
+/**
+ * Reads <tt>len</tt> consecutive registers starting at <tt>reg</tt> into <tt>buf</tt>
+ * through the bus of the chip (see <tt>ds3231_bus_ops_t</tt>).
  *
- * @see i2c_smbus_write_byte_data(i2c_client*, u8, u8)
+ * @param[in] chip The chip to operate on
+ * @return <tt>0</tt> on success, <tt>-ENODEV</tt> if the chip was removed and a kernel error
+ * code on failure.
  */
-int ds3231_write_time(ds3231_time_t *time);
+int ds3231_read_regs(ds3231_status_t *chip, u8 reg, u8 len, u8 *buf);
 
 /**
  * Reads the time from the DS3231 RTC chip into the given <tt>ds3231_time_t</tt> object.
- * First this function reads all needed data registers from the RTC, then converts them
- * back to decimal values (according the <tt>Timekeeping Registers</tt> on page 11 of
- * the DS3231 manual) to return to the caller. Because years are stored as beginning
- * from <tt>0</tt>, <tt>2000</tt> is added to compensate for that.
+ * First this function reads all time registers from the RTC in a single auto-incrementing
+ * block transfer, then converts them back to decimal values (according the <tt>Timekeeping
+ * Registers</tt> on page 11 of the DS3231 manual) to return to the caller. Because years are
+ * stored as beginning from <tt>0</tt>, <tt>2000</tt> is added to compensate for that.
  *
+ * Reading all registers in one transfer makes the RTC latch them at once, so a second or minute
+ * rolling over during the read cannot produce a torn timestamp. If the I2C adapter does not
+ * support block reads, the registers are read one by one and the read is repeated once if the
+ * seconds register changed in between.
+ *
+ * @param[in] chip The chip to operate on
  * @param[out] time Where to write the time to.
- * @return <tt>0</tt> on success and a kernel error code (returned by <tt>i2c_smbus_read_byte_data</tt>)
- * on failure.
+ * @return <tt>0</tt> on success and a kernel error code (returned by <tt>i2c_smbus_read_i2c_block_data</tt>
+ * or <tt>i2c_smbus_read_byte_data</tt>) on failure.
  *
- * @see i2c_smbus_read_byte_data(i2c_client*, u8)
+ * @see i2c_smbus_read_i2c_block_data(i2c_client*, u8, u8, u8*)
  */
-int ds3231_read_time(ds3231_time_t *time);
+int ds3231_read_time(ds3231_status_t *chip, ds3231_time_t *time);
 
 
 /**
- * Reads the status and temperature from the DS3231 RTC chip into the global <tt>ds3231_status_t</tt> object.
- * First this function reads all needed data registers from the RTC and writes them into the global <tt>ds3231_status</tt> object.
- * If the OSF is set, the control register is read from the RTC and written with activated OSF. The status register is also written
+ * Reads the status and temperature from the DS3231 RTC chip into its <tt>ds3231_status_t</tt> object.
+ * First this function reads the control, status, aging and temperature registers from the RTC in one block
+ * transfer and writes them into <tt>chip</tt>. The temperature is decoded with
+ * its full 10-bit resolution.
+ * If the OSF is set, the oscillator is re-enabled in the control register. The status register is also written
  * with OSF being set to 0. A kernel error code ist returned in this case.
  * If the temperature is above 85°C or below -40°C a kernel message is being send.
  *
- * @return <tt>0</tt> on success and a kernel error code (returned by <tt>i2c_smbus_read_byte_data</tt>)
+ * @param[in] chip The chip to operate on
+ * @return <tt>0</tt> on success and a kernel error code (returned by <tt>i2c_smbus_read_i2c_block_data</tt>)
  * on failure. If The OSF of the RTC was set this function returns <tt>-EAGAIN</tt>.
  *
- * @see i2c_smbus_read_byte_data(i2c_client*, u8)
+ * @see i2c_smbus_read_i2c_block_data(i2c_client*, u8, u8, u8*)
+ */
+int ds3231_read_status(ds3231_status_t *chip);
+
+/**
+ * Reads the whole register file (<tt>0x00</tt> to <tt>0x12</tt>) of the DS3231 RTC chip in a single burst
+ * and decodes both the time and the status from it. This combines <tt>ds3231_read_status(void)</tt> and
+ * <tt>ds3231_read_time(ds3231_time_t*)</tt> into one bus transaction.
+ *
+ * @param[in] chip The chip to operate on
+ * @param[out] time Where to write the time to.
+ * @return <tt>0</tt> on success and a kernel error code on failure. If the OSF of the RTC was set
+ * this function returns <tt>-EAGAIN</tt> and <tt>time</tt> is left untouched.
+ *
+ * @see ds3231_read_status(void)
+ * @see ds3231_read_time(ds3231_time_t*)
+ */
+int ds3231_read_snapshot(ds3231_status_t *chip, ds3231_time_t *time);
+
+
+/**
+ * Encodes a time into the time registers (indexed by register address) in 24 hour mode,
+ * setting the century bit for the years from <tt>2100</tt>.
+ * See <tt>Timekeeping Registers</tt> on page 11 of the DS3231 manual.
+ *
+ * @param[in] time The time to encode (years <tt>2000</tt> to <tt>2199</tt>)
+ * @param[out] regs The <tt>DS3231_NUM_TIME_REGS</tt> time registers
+ */
+void ds3231_encode_time(const ds3231_time_t *time, u8 *regs);
+
+/**
+ * Decodes the time registers (indexed by register address) of a chip in 24 hour mode.
+ * See <tt>Timekeeping Registers</tt> on page 11 of the DS3231 manual.
+ *
+ * @param[in] regs The <tt>DS3231_NUM_TIME_REGS</tt> time registers
+ * @param[out] time Where to write the time to.
+ */
+void ds3231_decode_time(const u8 *regs, ds3231_time_t *time);
+
+/**
+ * Returns the number of days of a month following the gregorian calendar, so 2000 is a
+ * leap year and 2100 is not.
+ *
+ * @param[in] year The year
+ * @param[in] month The month (1-12)
+ * @return The number of days of the month.
+ */
+unsigned int ds3231_month_days(unsigned int year, unsigned int month);
+
+/**
+ * Returns the day of the week of a date.
+ *
+ * @return The day of the week (1-7, where 1 is Monday).
+ */
+u8 ds3231_weekday(unsigned int year, unsigned int month, unsigned int day);
+
+/**
+ * Converts a <tt>ds3231_time_t</tt> to seconds since the epoch.
+ *
+ * @param[in] time The time to convert
+ * @return The number of seconds since <tt>1970-01-01 00:00:00</tt>.
+ */
+time64_t ds3231_time_to_secs(const ds3231_time_t *time);
+
+/**
+ * Converts seconds since the epoch to a <tt>ds3231_time_t</tt>, including the day of the week.
+ *
+ * @param[in] secs The number of seconds since <tt>1970-01-01 00:00:00</tt>
+ * @param[out] time Where to write the time to.
+ */
+void ds3231_secs_to_time(time64_t secs, ds3231_time_t *time);
+
+/**
+ * Returns the current time of the RTC, either by reading a snapshot from the chip or, if the
+ * <tt>cache_ms</tt> module parameter is set, by extrapolating the last snapshot with
+ * <tt>ktime_get()</tt>. The chip is only read again once the cached snapshot is older than
+ * <tt>cache_ms</tt> milliseconds. Every re-sync also refines the estimated position of the
+ * RTC's second boundary, so extrapolated readings converge onto the chip's seconds.
+ * Status fields in <tt>chip</tt> are only updated when the chip is actually read.
+ *
+ * Takes <tt>chip->lock</tt> and sleeps while the bus is in use. If another reader is
+ * already accessing the RTC, the caller sleeps until that read finishes and returns its result,
+ * so any number of concurrent readers costs only one bus access.
+ *
+ * @param[in] chip The chip to operate on
+ * @param[out] time Where to write the time to.
+ * @return <tt>0</tt> on success, <tt>-EINTR</tt> or <tt>-ERESTARTSYS</tt> if interrupted while waiting
+ * and the return value of <tt>ds3231_read_snapshot(ds3231_time_t*)</tt> on failure.
+ *
+ * @see ds3231_read_snapshot(ds3231_time_t*)
+ */
+int ds3231_get_time(ds3231_status_t *chip, ds3231_time_t *time);
+
+/**
+ * Narrows down the instant the RTC entered the second a read returned. The read started at
+ * <tt>start</tt> and ended at <tt>end</tt>, so the second began at or before <tt>end</tt> and,
+ * since a read starting one second earlier would still have returned the previous second,
+ * after <tt>start</tt> minus one second. The bounds of earlier reads, moved to this second by
+ * <tt>shift</tt> nanoseconds, are intersected with these. Once the lower bound passes the
+ * earlier anchor, the RTC runs slow and the anchor moves right behind the lower bound; once
+ * the earlier lower bound passes this read, the RTC runs fast and only this read is kept.
+ *
+ * @param[in,out] anchor Upper bound, the estimate of the second boundary
+ * @param[in,out] floor Lower bound of the second boundary
+ * @param[in] valid Whether <tt>anchor</tt> and <tt>floor</tt> hold the bounds of an earlier read
+ * @param[in] shift Whole seconds between the earlier read and this one in nanoseconds
+ * @param[in] start Monotonic time in nanoseconds right before the read
+ * @param[in] end Monotonic time in nanoseconds right after the read
+ * @return <tt>true</tt> if the earlier anchor was kept and <tt>false</tt> if it moved.
+ */
+bool ds3231_anchor_refine(s64 *anchor, s64 *floor, bool valid, s64 shift, s64 start, s64 end);
+
+/**
+ * Converts a <tt>ds3231_time_t</tt> to the kernel's <tt>struct rtc_time</tt>.
+ *
+ * @param[in] time The time to convert
+ * @param[out] tm Where to write the converted time to.
+ */
+void ds3231_time_to_rtc(const ds3231_time_t *time, struct rtc_time *tm);
+
+/**
+ * Converts the kernel's <tt>struct rtc_time</tt> to a <tt>ds3231_time_t</tt> after validating it.
+ *
+ * @param[in] tm The time to convert
+ * @param[out] time Where to write the converted time to.
+ * @return <tt>0</tt> on success, <tt>-EINVAL</tt> if <tt>tm</tt> is not a valid date and time and
+ * <tt>-EOVERFLOW</tt> if it lies outside of the years <tt>2000</tt> to <tt>2199</tt>.
+ */
+int ds3231_rtc_to_time(const struct rtc_time *tm, ds3231_time_t *time);
+
+/**
+ * Checks the register conversions if the <tt>codec_selftest</tt> module parameter is set: every
+ * BCD byte, every day from <tt>2000-01-01</tt> to <tt>2199-12-31</tt> (each at another time of day)
+ * and every second of <tt>2099-12-31</tt> go through encoding, decoding, the conversions to and
+ * from seconds and the day of the week, compared with a calendar walked day by day. The time
+ * every pass took is logged. Runs when an emulated chip is probed, so no hardware is needed.
+ *
+ * @return <tt>0</tt> if the conversions are correct or the parameter is not set and
+ * <tt>-EINVAL</tt> on the first mismatch, which is logged.
+ */
+int ds3231_codec_selftest(void);
+
+/**
+ * Handles the binary interface of the character device (see <tt>ds3231_ioctl.h</tt>).
+ * Time is exchanged as <tt>struct rtc_time</tt>, so no string formatting or parsing is
+ * needed on either side.
+ *
+ * This method is called by the linux kernel.
+ *
+ * @param[in] file The file handle the ioctl was issued on
+ * @param[in] cmd One of the <tt>DS3231_IOC_*</tt> commands
+ * @param[in,out] arg Userspace pointer to the argument of the command
+ * @return <tt>0</tt> on success, <tt>-ENOTTY</tt> for unknown commands, <tt>-EFAULT</tt> if the
+ * argument could not be copied and the error of the underlying operation otherwise.
+ */
+long ds3231_io_ioctl(struct file *file, unsigned int cmd, unsigned long arg);
+
+/**
+ * Reads the alarm registers of alarm <tt>n</tt> together with its enable and flag bits
+ * from the DS3231 RTC chip in one block transfer. The alarm is always programmed to match
+ * on date, hour, minute and second (see <tt>ds3231_write_alarm(u8, const ds3231_alarm_t*)</tt>).
+ *
+ * @param[in] chip The chip to operate on
+ * @param[in] n The alarm to read (<tt>1</tt> or <tt>2</tt>)
+ * @param[out] alarm Where to write the alarm to.
+ * @return <tt>0</tt> on success, <tt>-EINVAL</tt> for an invalid alarm and a kernel error code
+ * on failure.
+ */
+int ds3231_read_alarm(ds3231_status_t *chip, u8 n, ds3231_alarm_t *alarm);
+
+/**
+ * Programs alarm <tt>n</tt> of the DS3231 RTC chip to fire once the date, hour, minute and
+ * second (alarm 1 only) of the RTC match <tt>alarm</tt>. The alarm flag is cleared and the
+ * alarm interrupt enable bit is set according to <tt>alarm->enabled</tt>. Since month and year
+ * are not compared, an enabled alarm fires again every month until it is disabled.
+ *
+ * @param[in] chip The chip to operate on
+ * @param[in] n The alarm to program (<tt>1</tt> or <tt>2</tt>)
+ * @param[in] alarm The alarm to program
+ * @return <tt>0</tt> on success, <tt>-EINVAL</tt> for an invalid alarm and a kernel error code
+ * on failure.
+ */
+int ds3231_write_alarm(ds3231_status_t *chip, u8 n, const ds3231_alarm_t *alarm);
+
+/**
+ * Reads the alarm flags from the DS3231 RTC chip and clears the flags of all enabled alarms
+ * that fired with a single write to the status register.
+ *
+ * @param[in] chip The chip to operate on
+ * @param[out] fired The flags (<tt>DS3231_MASK_A1F</tt>, <tt>DS3231_MASK_A2F</tt>) of the alarms that fired
+ * @return <tt>0</tt> on success and a kernel error code on failure.
+ */
+int ds3231_ack_alarms(ds3231_status_t *chip, u8 *fired);
+
+/**
+ * Registers the RTC with the kernel's RTC class, so it is available as <tt>/dev/rtcN</tt>,
+ * through the standard RTC ioctls and for <tt>hctosys</tt>. The registration is managed
+ * and undone automatically when the I2C device is removed.
+ *
+ * @param[in] chip The chip to operate on
+ * @return <tt>0</tt> on success and the error returned by <tt>devm_rtc_device_register</tt> on failure.
+ * @ingroup Initialization
+ */
+int ds3231_rtc_init(ds3231_status_t *chip);
+
+/**
+ * Sets up the interrupt of the INT/SQW pin of the RTC if the device tree or ACPI describes one
+ * for the chip, or else if the pin is wired to the GPIO given by the <tt>sqw_gpio</tt> module
+ * parameter. The interrupt has a hard and a threaded handler.
+ *
+ * In square wave mode (<tt>sqw</tt> module parameter) every falling edge (which coincides with the
+ * RTC's seconds update) increments <tt>chip->tick</tt> and wakes up everyone polling the
+ * character device. If the <tt>pps</tt> module parameter is set, the edge is also reported to a PPS
+ * source, timestamped first thing in hard interrupt context. While an alarm is enabled the threaded
+ * handler checks the alarm flags on every edge.
+ *
+ * In alarm mode the pin only asserts when an alarm fires and every interrupt goes to the threaded
+ * handler, which acknowledges the alarm flags (see <tt>ds3231_ack_alarms(u8*)</tt>), notifies the
+ * RTC class and wakes up everyone waiting in <tt>DS3231_IOC_WAIT_ALARM</tt>.
+ *
+ * GPIO and interrupt are released automatically when the I2C device is removed.
+ *
+ * @param[in] chip The chip to operate on
+ * @return <tt>0</tt> on success or if no interrupt was configured and a kernel error code on failure.
+ * @ingroup Initialization
+ */
+int ds3231_irq_init(ds3231_status_t *chip);
+
+/**
+ * Disables the square wave interrupt and unregisters the PPS source, if any.
+ * @ingroup Termination
+ */
+void ds3231_irq_exit(ds3231_status_t *chip);
+
+/**
+ * Reports whether the character device can be read without blocking. Without the square wave
+ * interrupt a file handle is always readable. With the interrupt it becomes readable again on
+ * every new RTC second, so waiters sleep until the seconds tick instead of spinning.
+ * Handles opened with <tt>O_NONBLOCK</tt> become readable once the text rendered by the read
+ * work is ready (a due render is submitted by polling) and writable while no write is in flight.
+ *
+ * This method is called by the linux kernel.
+ *
+ * @param[in] file The file handle being polled
+ * @param[in] wait The poll table to register the wait queue with
+ * @return <tt>POLLIN | POLLRDNORM</tt> if the file is readable, <tt>POLLOUT | POLLWRNORM</tt> if a
+ * non-blocking handle is writable, <tt>POLLERR</tt> if its last write failed and <tt>POLLPRI</tt>
+ * for expired timers and finished conversions.
+ */
+unsigned int ds3231_io_poll(struct file *file, poll_table *wait);
+
+/**
+ * Maps the shared time page of the chip (<tt>struct ds3231_time_page</tt>) read-only, so
+ * userspace reads time, temperature and oscillator state without entering the kernel. Reads
+ * the chip first if the page does not hold a time yet.
+ *
+ * This method is called by the linux kernel.
+ *
+ * @param[in] file The file handle being mapped
+ * @param[in] vma The mapping requested by userspace
+ * @return <tt>0</tt> on success and a kernel error code on failure (see <tt>ds3231_page_mmap</tt>).
+ */
+int ds3231_io_mmap(struct file *file, struct vm_area_struct *vma);
+
+/**
+ * Registers a timer that expires once the RTC reaches <tt>expires</tt>. All timers share alarm 1:
+ * it is always programmed with the earliest pending deadline and re-armed from the interrupt
+ * thread when it fires. Expired timers are handed to the file handle that registered them.
+ * Alarm 1 cannot be used through the RTC class or <tt>DS3231_IOC_SET_ALARM</tt> while timers
+ * are pending.
+ *
+ * @param[in] priv The file handle that owns the timer
+ * @param[in] expires The deadline in RTC seconds since the epoch
+ * @param[in] cookie A value identifying the timer to its owner
+ * @return <tt>0</tt> on success, <tt>-EOPNOTSUPP</tt> without interrupt, <tt>-EBUSY</tt> if alarm 1
+ * is in use, <tt>-ENOSPC</tt> if the file handle has too many timers and a kernel error code otherwise.
+ */
+int ds3231_timer_add(ds3231_file_t *priv, time64_t expires, u64 cookie);
+
+/**
+ * Removes all pending timers of <tt>priv</tt> with the given cookie.
+ *
+ * @return <tt>0</tt> on success, <tt>-ENOENT</tt> if no such timer is pending and a kernel error
+ * code if re-arming alarm 1 failed.
+ */
+int ds3231_timer_del(ds3231_file_t *priv, u64 cookie);
+
+/**
+ * Takes the oldest expired timer of <tt>priv</tt> and returns its cookie.
+ *
+ * @return <tt>0</tt> on success and <tt>-EAGAIN</tt> if no timer expired.
+ */
+int ds3231_timer_pop_expired(ds3231_file_t *priv, u64 *cookie);
+
+/**
+ * Removes all pending and expired timers of a file handle that is being closed.
+ */
+void ds3231_timer_release(ds3231_file_t *priv);
+
+/**
+ * Expires due timers and re-arms alarm 1 with the next deadline. Called from the interrupt
+ * thread when alarm 1 fired while it is owned by the timer queue.
+ */
+void ds3231_timer_run(ds3231_status_t *chip);
+
+/**
+ * Reads the temperature registers of the DS3231 RTC chip in one block transfer and decodes
+ * them with the full 0.25 °C resolution.
+ *
+ * @param[in] chip The chip to operate on
+ * @param[out] temp The temperature in 1/4 °C steps
+ * @return <tt>0</tt> on success and a kernel error code on failure.
+ */
+int ds3231_read_temp(ds3231_status_t *chip, s16 *temp);
+
+/**
+ * Prepares the temperature sampler, which is started by <tt>ds3231_temp_apply</tt>.
+ * The sampler reads the temperature every <tt>temp_period_ms</tt> milliseconds from a
+ * <tt>delayed_work</tt>, publishes it in <tt>chip->temp</tt> and stores it with a
+ * timestamp in a ring buffer of <tt>DS3231_TEMP_HISTORY</tt> samples. While it runs, register
+ * snapshots skip the temperature registers.
+ * @ingroup Initialization
+ */
+void ds3231_temp_init(ds3231_status_t *chip);
+
+/**
+ * Brings the temperature sampler in line with the <tt>temp_period_ms</tt> module parameter:
+ * starts it, moves its next sample to the new period or stops it. Called once the chip is set
+ * up and for every chip whenever the parameter is written. Takes <tt>chip->lock</tt>.
+ *
+ * @param[in] chip The chip to operate on
+ */
+void ds3231_temp_apply(ds3231_status_t *chip);
+
+/**
+ * Stops the temperature sampler.
+ * @ingroup Termination
+ */
+void ds3231_temp_exit(ds3231_status_t *chip);
+
+/**
+ * Copies up to <tt>count</tt> of the most recent temperature samples into <tt>samples</tt>,
+ * oldest first.
+ *
+ * @param[in] chip The chip to operate on
+ * @return The number of samples copied.
+ */
+unsigned int ds3231_temp_history(ds3231_status_t *chip, ds3231_temp_sample_t *samples, unsigned int count);
+
+/**
+ * Starts a temperature conversion by setting the CONV bit, unless the chip is busy with
+ * its own conversion. Does not wait; see <tt>ds3231_temp_convert</tt> for a start that is
+ * deferred until BSY clears.
+ *
+ * @param[in] chip The chip to operate on
+ * @return <tt>0</tt> on success, <tt>-EBUSY</tt> if BSY is set and a kernel error code on failure.
+ */
+int ds3231_start_conversion(ds3231_status_t *chip);
+
+/**
+ * Reads CONV and the temperature of the DS3231 RTC chip in one block transfer.
+ *
+ * @param[in] chip The chip to operate on
+ * @param[out] temp The temperature in 1/4 °C steps, if the conversion finished
+ * @return <tt>0</tt> if the conversion finished, <tt>-EINPROGRESS</tt> if it is still running
+ * and a kernel error code on failure.
+ */
+int ds3231_read_conversion(ds3231_status_t *chip, s16 *temp);
+
+/**
+ * Requests a forced temperature conversion and returns immediately. If a conversion is
+ * already running the request joins it. While the chip runs its own conversion (BSY), the
+ * work item polls BSY and sets CONV once it clears. Completion is checked from the same work
+ * item, which only briefly takes the bus lock, so other bus users are not blocked meanwhile.
+ * When it finishes, <tt>chip->conv_done</tt> is set to the sequence number and
+ * <tt>chip->conv_wait</tt> is woken up.
+ *
+ * @param[in] chip The chip to operate on
+ * @param[out] seq Sequence number of the conversion to wait for
+ * @return <tt>0</tt> on success, <tt>-ENODEV</tt> if the chip was removed and a kernel error
+ * code on failure.
+ */
+int ds3231_temp_convert(ds3231_status_t *chip, u32 *seq);
+
+/**
+ * Same as <tt>ds3231_temp_convert</tt> for callers that already hold <tt>chip->lock</tt>.
+ *
+ * @param[in] chip The chip to operate on
+ * @param[out] seq Sequence number of the conversion to wait for
+ * @return <tt>0</tt> on success, <tt>-ENODEV</tt> if the chip was removed and a kernel error
+ * code on failure.
+ */
+int ds3231_temp_convert_locked(ds3231_status_t *chip, u32 *seq);
+
+/**
+ * Returns the result of the last finished forced conversion.
+ *
+ * @param[in] chip The chip to operate on
+ * @param[out] temp The temperature in 1/4 °C steps
+ * @return <tt>0</tt> on success and the error the conversion failed with otherwise.
+ */
+int ds3231_temp_conv_result(ds3231_status_t *chip, s16 *temp);
+
+/**
+ * Adds <tt>delta</tt> to the aging offset register (clamped to its range) and requests a
+ * forced temperature conversion (see <tt>ds3231_temp_convert_locked</tt>), which is when the
+ * chip applies the new offset. One LSB changes
+ * the frequency of the oscillator by roughly 0.1 ppm; positive values slow it down.
+ * The caller has to hold <tt>chip->lock</tt>.
+ *
+ * @param[in] chip The chip to operate on
+ * @return <tt>0</tt> on success and a kernel error code on failure.
+ */
+int ds3231_adjust_aging(ds3231_status_t *chip, int delta);
+
+/**
+ * Starts the aging offset calibration. While the <tt>calib_window_s</tt> module parameter is
+ * set and <tt>calib_synced</tt> asserts that <tt>CLOCK_REALTIME</tt> is NTP-synchronized,
+ * a work item measures the offset of <tt>CLOCK_REALTIME</tt> against the RTC at square wave
+ * edges. At the end of every window the drift rate is derived from the change of the offset
+ * and the aging offset register is adjusted by at most <tt>calib_max_step</tt>.
+ * Requires square wave interrupts (see <tt>ds3231_irq_init</tt>).
+ * @ingroup Initialization
+ */
+void ds3231_calib_init(ds3231_status_t *chip);
+
+/**
+ * Stops the aging offset calibration.
+ * @ingroup Termination
+ */
+void ds3231_calib_exit(ds3231_status_t *chip);
+
+/**
+ * Returns the state and the current drift estimate of the aging offset calibration.
+ *
+ * @param[in] chip The chip to operate on
+ * @param[out] calib The state of the calibration
+ */
+void ds3231_calib_read(ds3231_status_t *chip, struct ds3231_ioc_calib *calib);
+
+/**
+ * Emits the <tt>ds3231_op_begin</tt> tracepoint and returns the start time of an operation,
+ * to be passed to <tt>ds3231_op_end</tt> once the operation finished.
+ *
+ * @param[in] chip The chip to operate on
+ * @param[in] op The operation that starts (one of <tt>DS3231_OP_*</tt>)
+ * @return The monotonic time the operation started at.
+ */
+ktime_t ds3231_op_begin(ds3231_status_t *chip, int op);
+
+/**
+ * Emits the <tt>ds3231_op_end</tt> tracepoint and records the latency and result of an
+ * operation in the statistics of the chip.
+ *
+ * @param[in] chip The chip to operate on
+ * @param[in] op The operation that finished (one of <tt>DS3231_OP_*</tt>)
+ * @param[in] start The time returned by <tt>ds3231_op_begin</tt>
+ * @param[in] result The return value of the operation
+ * @return <tt>result</tt>, so the caller can return it directly.
+ */
+int ds3231_op_end(ds3231_status_t *chip, int op, ktime_t start, int result);
+
+/**
+ * Counts a request rejected because the chip or alarm 1 is busy and emits the
+ * <tt>ds3231_busy</tt> tracepoint.
+ *
+ * @param[in] chip The chip to operate on
+ * @return <tt>-EBUSY</tt>, so the caller can return it directly.
+ */
+int ds3231_reject_busy(ds3231_status_t *chip);
+
+/**
+ * Creates the <tt>ds3231</tt> directory in debugfs. The driver works without debugfs, so
+ * failures are ignored.
+ * @ingroup Initialization
+ */
+void ds3231_debug_init(void);
+
+/**
+ * Removes the <tt>ds3231</tt> directory from debugfs.
+ * @ingroup Termination
+ */
+void ds3231_debug_exit(void);
+
+/**
+ * Creates the debugfs directory of a chip, named after its I2C device, with a <tt>stats</tt>
+ * file showing the number of <tt>-EBUSY</tt> rejections and, per operation, the number of
+ * calls and errors, average and maximum latency and a log2 latency histogram.
+ *
+ * @param[in] chip The chip to add the debugfs directory for
+ */
+void ds3231_debug_add(ds3231_status_t *chip);
+
+/**
+ * Removes the debugfs directory of a chip.
+ *
+ * @param[in] chip The chip to remove the debugfs directory of
+ */
+void ds3231_debug_remove(ds3231_status_t *chip);
+
+/**
+ * Switches the chip to an emulated register model if the <tt>emulate</tt> module parameter is
+ * set or the chip sits on an <tt>i2c-stub</tt> adapter. The model keeps the time registers
+ * ticking (adjusted by the aging offset), sets OSF on power-up, sets the alarm flags when the
+ * alarm registers match, runs temperature conversions with BSY every 64 seconds and on CONV and
+ * reports the temperature given by <tt>emul_temp</tt>. Every transfer is delayed by
+ * <tt>emul_latency_us</tt> and fails with <tt>-EIO</tt> at a rate of <tt>emul_error_rate</tt>
+ * per mille. The INT/SQW pin is not emulated. The model is released with the I2C device.
+ *
+ * @param[in] chip The chip to operate on
+ * @return <tt>0</tt> on success and <tt>-ENOMEM</tt> if the model could not be allocated.
+ */
+int ds3231_emul_attach(ds3231_status_t *chip);
+
+/**
+ * Sets the RTC to <tt>CLOCK_REALTIME</tt> at the next second boundary. The time registers are
+ * encoded ahead of time and the caller sleeps on a <tt>CLOCK_REALTIME</tt> hrtimer until
+ * shortly before the boundary. It then takes the bus and issues the write one measured bus
+ * latency early, so the chip restarts its second right at the boundary. If another user holds
+ * the bus past that point, the write moves on to the next second. The achieved error is
+ * estimated from the write and, with the square wave interrupt, measured at the next edge.
+ *
+ * @param[in] chip The chip to operate on
+ * @param[out] sync The second the RTC was set to and the achieved error
+ * @return <tt>0</tt> on success, <tt>-EINTR</tt> if interrupted, <tt>-EOVERFLOW</tt> if the system
+ * time is outside of the years 2000 to 2199, <tt>-EBUSY</tt> if the bus was taken too late for
+ * three boundaries in a row and a kernel error code on failure.
+ */
+int ds3231_sync_time(ds3231_status_t *chip, struct ds3231_ioc_sync *sync);
+
+/**
+ * Allocates the page shared with userspace through <tt>mmap()</tt>.
+ *
+ * @param[in] chip The chip to operate on
+ * @return <tt>0</tt> on success and <tt>-ENOMEM</tt> on failure.
+ */
+int ds3231_page_alloc(ds3231_status_t *chip);
+
+/**
+ * Drops the driver's reference to the shared page. Existing mappings keep the page alive.
+ *
+ * @param[in] chip The chip to operate on
+ */
+void ds3231_page_free(ds3231_status_t *chip);
+
+/**
+ * Publishes the time read from the RTC. The anchor converges onto the RTC's second boundary
+ * like the one of the time cache. The caller has to hold <tt>chip->lock</tt>.
+ *
+ * @param[in] chip The chip to operate on
+ * @param[in] secs The RTC time in seconds since the epoch
+ * @param[in] start Monotonic time right before the read (the registers were latched after it)
+ * @param[in] now Monotonic time right after the read
+ */
+void ds3231_page_set_time(ds3231_status_t *chip, time64_t secs, ktime_t start, ktime_t now);
+
+/**
+ * Counts a square wave edge in <tt>chip->tick</tt> and <tt>chip->tick_time</tt> and moves the
+ * anchor of the shared page onto it. Called from hard interrupt context.
+ *
+ * @param[in] chip The chip to operate on
+ * @param[in] edge Monotonic time of the edge
+ */
+void ds3231_page_tick(ds3231_status_t *chip, ktime_t edge);
+
+/**
+ * Returns the time of the last square wave edge. The 64-bit time is read under
+ * <tt>chip->page_lock</tt>, so it cannot tear against the interrupt on 32-bit machines.
+ *
+ * @param[in] chip The chip to operate on
+ * @param[out] tick The value of <tt>chip->tick</tt> belonging to the edge
+ * @return Monotonic time of the edge.
+ */
+ktime_t ds3231_tick_time(ds3231_status_t *chip, u32 *tick);
+
+/**
+ * Publishes <tt>chip->temp</tt> and <tt>chip->osf</tt>. A set oscillator stop flag also
+ * invalidates the time. The caller has to hold <tt>chip->lock</tt>.
+ *
+ * @param[in] chip The chip to operate on
+ */
+void ds3231_page_set_status(ds3231_status_t *chip);
+
+/**
+ * Marks the time in the shared page invalid, e.g. because the time registers were written.
+ *
+ * @param[in] chip The chip to operate on
+ */
+void ds3231_page_invalidate(ds3231_status_t *chip);
+
+/**
+ * Maps the shared page read-only into <tt>vma</tt>, which must cover exactly one page at
+ * offset 0.
+ *
+ * @param[in] chip The chip to operate on
+ * @param[in] vma The mapping requested by userspace
+ * @return <tt>0</tt> on success, <tt>-EINVAL</tt> for a wrong size or offset, <tt>-EPERM</tt> for a
+ * writable mapping and a kernel error code on failure.
+ */
+int ds3231_page_mmap(ds3231_status_t *chip, struct vm_area_struct *vma);
+
+/**
+ * Extrapolates the RTC time from the anchor of the shared page with <tt>ktime_get()</tt>.
+ *
+ * @param[in] chip The chip to operate on
+ * @param[out] secs RTC time in seconds since the epoch (untouched for <tt>DS3231_TS_NONE</tt>)
+ * @param[out] nsec Nanoseconds elapsed since the RTC entered <tt>secs</tt> (untouched for <tt>DS3231_TS_NONE</tt>)
+ * @return One of the <tt>DS3231_TS_*</tt> sources: <tt>DS3231_TS_EDGE</tt> if the anchor is a square wave
+ * edge at most 1.5 seconds old, <tt>DS3231_TS_ESTIMATED</tt> if it was estimated from reads and
+ * <tt>DS3231_TS_NONE</tt> if the page holds no time.
+ */
+int ds3231_page_read_time(ds3231_status_t *chip, time64_t *secs, u32 *nsec);
+
+/**
+ * Returns the current time of the RTC with a sub-second fraction. The time is read with
+ * <tt>ds3231_get_time</tt> (so no bus access is added) and the fraction is the monotonic time
+ * elapsed since the last square wave edge or, without the square wave interrupt, since the
+ * second boundary estimated from reads of the chip.
+ *
+ * @param[in] chip The chip to operate on
+ * @param[out] ts The time and the source of its fraction
+ * @return <tt>0</tt> on success and the return value of <tt>ds3231_get_time</tt> on failure.
+ */
+int ds3231_get_timestamp(ds3231_status_t *chip, struct ds3231_ioc_timestamp *ts);
+
+/**
+ * Transfers registers through the bus of the chip and retries transient errors. Every retry
+ * waits twice as long as the one before, starting at <tt>retry_backoff_us</tt>, up to
+ * <tt>retry_max</tt> retries and as long as the transfer stays within <tt>retry_deadline_us</tt>.
+ * Before the second retry the bus is recovered if the adapter supports it. The outcome drives
+ * the health state of the chip: retries make it degraded, a failure after all retries makes it
+ * recovering and 32 clean transfers in a row make it healthy again.
+ *
+ * @param[in] chip The chip to operate on
+ * @param[in] write True to write <tt>buf</tt> to the registers, false to read them into <tt>buf</tt>
+ * @param[in] reg The first register
+ * @param[in] len The number of registers
+ * @param buf The register values
+ * @return <tt>0</tt> on success and the error of the last attempt on failure.
+ */
+int ds3231_health_xfer(ds3231_status_t *chip, bool write, u8 reg, u8 len, u8 *buf);
+
+/**
+ * Answers a failed read with the time extrapolated from the shared time page if the chip is
+ * recovering and the last successful transfer is at most <tt>stale_max_s</tt> seconds old.
+ * The caller has to hold <tt>chip->lock</tt>.
+ *
+ * @param[in] chip The chip to operate on
+ * @param[out] time The extrapolated time
+ * @param[in] error The error of the failed read
+ * @return <tt>0</tt> if <tt>time</tt> was filled in and <tt>error</tt> otherwise.
+ */
+int ds3231_health_stale_time(ds3231_status_t *chip, ds3231_time_t *time, int error);
+
+/**
+ * Returns the name of a <tt>DS3231_HEALTH_*</tt> state.
+ *
+ * @param[in] state The state
+ * @return The name of the state.
  */
-int ds3231_read_status(void);
+const char *ds3231_health_name(u8 state);
@@ -0,0 +1,235 @@
+/*******************************************************
+ * ( ) ds3231_hw.c     :: Hardware interfacing         *
+ * ( ) ds3231_health.c :: Bus error recovery           *
+ * ( ) ds3231_codec.c  :: Register conversion          *
+ * ( ) ds3231_emul.c   :: Emulated register model      *
+ * ( ) ds3231_sync.c   :: Second-aligned time setting  *
+ * ( ) ds3231_page.c   :: Shared time page             *
+ * ( ) ds3231_irq.c    :: Interrupt handling           *
+ * ( ) ds3231_timer.c  :: Alarm timer multiplexing     *
+ * ( ) ds3231_temp.c   :: Temperature sampling         *
+ * (*) ds3231_calib.c  :: Aging offset calibration     *
+ * ( ) ds3231_debug.c  :: Tracing and statistics       *
+ * ( ) ds3231_io.c     :: Character device interfacing *
+ * ( ) ds3231_rtc.c    :: RTC class interfacing        *
+ * ( ) ds3231_mod.c    :: Linux module handling        *
+ *******************************************************/
+#include "ds3231.h"
+
+/** Length of a calibration window in seconds (<tt>0</tt> disables the calibration) */
+static unsigned int calib_window_s;
+module_param(calib_window_s, uint, 0644);
+MODULE_PARM_DESC(calib_window_s, "Adjust the aging offset after tracking the RTC against the system clock for calib_window_s seconds (0 = off, at least 3600)");
+
+/** Asserted by userspace while <tt>CLOCK_REALTIME</tt> is NTP-synchronized */
+static bool calib_synced;
+module_param(calib_synced, bool, 0644);
+MODULE_PARM_DESC(calib_synced, "Set to 1 while the system clock is NTP-synchronized (calibration only measures while set)");
+
+/** Maximum change of the aging offset register per window */
+static unsigned int calib_max_step = 2;
+module_param(calib_max_step, uint, 0644);
+MODULE_PARM_DESC(calib_max_step, "Maximum change of the aging offset register (0.1 ppm steps) per calibration window");
+
+/** Interval between two offset measurements in seconds */
+#define DS3231_CALIB_SAMPLE_S 600
+/** Shortest window the drift is estimated and the aging offset adjusted over */
+#define DS3231_CALIB_MIN_WINDOW_S 3600
+/** Approximate frequency change per LSB of the aging offset register */
+#define DS3231_CALIB_PPB_PER_LSB 100
+/** Drift below which the aging offset is left alone */
+#define DS3231_CALIB_DEADBAND_PPB 50
+/** Largest drift between two measurements that is not considered a step of either clock */
+#define DS3231_CALIB_MAX_PPM 100
+/** Allowance for the latency of the square wave interrupt between two measurements */
+#define DS3231_CALIB_JITTER_NS (10 * NSEC_PER_MSEC)
+
+/**
+ * Measures the offset of <tt>CLOCK_REALTIME</tt> against the RTC at the next square wave edge,
+ * which coincides with the RTC's seconds update.
+ *
+ * @param[out] now_ns <tt>CLOCK_REALTIME</tt> of the edge in nanoseconds
+ * @param[out] offset_ns <tt>CLOCK_REALTIME</tt> minus the RTC time at the edge in nanoseconds
+ * @return <tt>0</tt> on success, <tt>-EAGAIN</tt> if the RTC could not be read within the
+ * second of the edge and a kernel error code on failure.
+ */
+static int ds3231_calib_measure(ds3231_status_t *chip, s64 *now_ns, s64 *offset_ns)
+{
+    ds3231_time_t time;
+    ktime_t edge;
+    u32 tick = READ_ONCE(chip->tick);
+    int retval;
+
+    /* The interrupt wakes tick_wait with wake_up_interruptible_all, so sleep interruptibly */
+    if (wait_event_interruptible_timeout(chip->tick_wait, READ_ONCE(chip->tick) != tick, 2 * HZ) <= 0) {
+        return -ETIMEDOUT;
+    }
+
+    edge = ds3231_tick_time(chip, &tick);
+
+    mutex_lock(&chip->lock);
+    retval = ds3231_read_time(chip, &time);
+    mutex_unlock(&chip->lock);
+    if (retval < 0) {
+        return retval;
+    }
+
+    /* The time read must belong to the edge */
+    if (READ_ONCE(chip->tick) != tick) {
+        return -EAGAIN;
+    }
+
+    *now_ns = ktime_to_ns(ktime_mono_to_real(edge));
+    *offset_ns = *now_ns - ds3231_time_to_secs(&time) * NSEC_PER_SEC;
+    return 0;
+}
+
+
+/** Starts a new calibration window at the given measurement. The caller has to hold <tt>chip->lock</tt> */
+static void ds3231_calib_begin(ds3231_status_t *chip, s64 now_ns, s64 offset_ns)
+{
+    chip->calib_state = DS3231_CALIB_TRACKING;
+    chip->calib_writes = chip->time_writes;
+    chip->calib_start_ns = now_ns;
+    chip->calib_start_offset = offset_ns;
+    chip->calib_last_ns = now_ns;
+    chip->calib_last_offset = offset_ns;
+}
+
+
+/**
+ * Adds a measurement to the current window, updates the drift estimate and adjusts the aging
+ * offset once the window is complete. The caller has to hold <tt>chip->lock</tt>.
+ */
+static void ds3231_calib_update(ds3231_status_t *chip, s64 now_ns, s64 offset_ns, unsigned int window)
+{
+    s64 elapsed_ms, step;
+    int lsb, max_step = READ_ONCE(calib_max_step);
+    s32 drift;
+
+    /* Setting the time of the RTC starts over */
+    if (chip->calib_state != DS3231_CALIB_TRACKING || chip->calib_writes != chip->time_writes) {
+        ds3231_calib_begin(chip, now_ns, offset_ns);
+        return;
+    }
+
+    /* So does a step of either clock since the last measurement */
+    step = abs(offset_ns - chip->calib_last_offset);
+    if (step > div_s64(now_ns - chip->calib_last_ns, USEC_PER_SEC) * DS3231_CALIB_MAX_PPM + DS3231_CALIB_JITTER_NS) {
+        pr_info("ds3231: calibration window restarted after a %lld ns clock step\n", step);
+        ds3231_calib_begin(chip, now_ns, offset_ns);
+        return;
+    }
+
+    chip->calib_last_ns = now_ns;
+    chip->calib_last_offset = offset_ns;
+
+    elapsed_ms = div_s64(now_ns - chip->calib_start_ns, NSEC_PER_MSEC);
+    if (elapsed_ms < DS3231_CALIB_MIN_WINDOW_S * MSEC_PER_SEC) {
+        return;
+    }
+
+    /* A fast RTC gains on CLOCK_REALTIME, so the offset shrinks */
+    drift = -div64_s64((offset_ns - chip->calib_start_offset) * 1000, elapsed_ms);
+    chip->calib_drift_ppb = drift;
+    chip->calib_valid = 1;
+
+    if (elapsed_ms < (s64)window * MSEC_PER_SEC) {
+        return;
+    }
+
+    /* Positive aging offsets slow the oscillator down */
+    lsb = abs(drift) < DS3231_CALIB_DEADBAND_PPB ? 0 : DIV_ROUND_CLOSEST(drift, DS3231_CALIB_PPB_PER_LSB);
+    lsb = clamp(lsb, -max_step, max_step);
+    if (lsb != 0) {
+        if (ds3231_adjust_aging(chip, lsb) < 0) {
+            pr_err("ds3231: could not adjust aging offset\n");
+        } else {
+            chip->calib_adjustments++;
+            pr_info("ds3231: drift %d ppb, aging offset adjusted by %d to %d\n", drift, lsb, chip->aging);
+        }
+    }
+
+    /* The drift estimate is stale once the aging offset changed */
+    ds3231_calib_begin(chip, now_ns, offset_ns);
+}
+
+
+/** Takes one measurement every <tt>DS3231_CALIB_SAMPLE_S</tt> seconds while the calibration is enabled */
+static void ds3231_calib_work(struct work_struct *work)
+{
+    ds3231_status_t *chip = container_of(to_delayed_work(work), ds3231_status_t, calib_work);
+    unsigned int window = READ_ONCE(calib_window_s);
+    s64 now_ns, offset_ns;
+    int retval;
+
+    if (window == 0 || !READ_ONCE(calib_synced)) {
+        mutex_lock(&chip->lock);
+        chip->calib_state = window == 0 ? DS3231_CALIB_OFF : DS3231_CALIB_HOLD;
+        mutex_unlock(&chip->lock);
+        goto resched;
+    }
+
+    retval = ds3231_calib_measure(chip, &now_ns, &offset_ns);
+    if (retval == -EAGAIN) {
+        retval = ds3231_calib_measure(chip, &now_ns, &offset_ns);
+    }
+
+    if (retval < 0) {
+        pr_warn("ds3231: calibration measurement failed (%d)\n", retval);
+        goto resched;
+    }
+
+    mutex_lock(&chip->lock);
+    ds3231_calib_update(chip, now_ns, offset_ns, max_t(unsigned int, window, DS3231_CALIB_MIN_WINDOW_S));
+    mutex_unlock(&chip->lock);
+
+resched:
+    if (!READ_ONCE(chip->removed)) {
+        schedule_delayed_work(&chip->calib_work, DS3231_CALIB_SAMPLE_S * HZ);
+    }
+}
+
+
+void ds3231_calib_init(ds3231_status_t *chip)
+{
+    INIT_DELAYED_WORK(&chip->calib_work, ds3231_calib_work);
+    chip->calib_state = DS3231_CALIB_OFF;
+    chip->calib_valid = 0;
+    chip->calib_adjustments = 0;
+
+    /* Measurements are taken at the square wave edges */
+    if (!chip->ticking) {
+        if (calib_window_s != 0) {
+            pr_warn("ds3231: aging offset calibration requires the square wave on sqw_gpio\n");
+        }
+        return;
+    }
+
+    schedule_delayed_work(&chip->calib_work, 0);
+}
+
+
+void ds3231_calib_exit(ds3231_status_t *chip)
+{
+    /* The work item is initialized even without the square wave and cancelling an idle one is harmless */
+    cancel_delayed_work_sync(&chip->calib_work);
+}
+
+
+void ds3231_calib_read(ds3231_status_t *chip, struct ds3231_ioc_calib *calib)
+{
+    memset(calib, 0, sizeof(*calib));
+
+    mutex_lock(&chip->lock);
+    calib->state = chip->calib_state;
+    calib->aging = chip->aging;
+    calib->valid = chip->calib_valid;
+    calib->drift_ppb = chip->calib_drift_ppb;
+    calib->adjustments = chip->calib_adjustments;
+    if (chip->calib_state == DS3231_CALIB_TRACKING) {
+        calib->offset_ns = chip->calib_last_offset;
+        calib->window_s = div_s64(chip->calib_last_ns - chip->calib_start_ns, NSEC_PER_SEC);
+    }
+    mutex_unlock(&chip->lock);
+}
@@ -0,0 +1,297 @@
+/*******************************************************
+ * ( ) ds3231_hw.c     :: Hardware interfacing         *
+ * ( ) ds3231_health.c :: Bus error recovery           *
+ * (*) ds3231_codec.c  :: Register conversion          *
+ * ( ) ds3231_emul.c   :: Emulated register model      *
+ * ( ) ds3231_sync.c   :: Second-aligned time setting  *
+ * ( ) ds3231_page.c   :: Shared time page             *
+ * ( ) ds3231_irq.c    :: Interrupt handling           *
+ * ( ) ds3231_timer.c  :: Alarm timer multiplexing     *
+ * ( ) ds3231_temp.c   :: Temperature sampling         *
+ * ( ) ds3231_calib.c  :: Aging offset calibration     *
+ * ( ) ds3231_debug.c  :: Tracing and statistics       *
+ * ( ) ds3231_io.c     :: Character device interfacing *
+ * ( ) ds3231_rtc.c    :: RTC class interfacing        *
+ * ( ) ds3231_mod.c    :: Linux module handling        *
+ *******************************************************/
+#include <linux/sched.h>
+
+#include "ds3231.h"
+
+/** Sixteen decoded BCD bytes with high nibble <tt>h</tt> (nibbles above 9 weighted arithmetically) */
+#define DS3231_BCD_ROW(h)                                                                   \
+    (h) * 10 + 0, (h) * 10 + 1, (h) * 10 + 2, (h) * 10 + 3, (h) * 10 + 4, (h) * 10 + 5,     \
+    (h) * 10 + 6, (h) * 10 + 7, (h) * 10 + 8, (h) * 10 + 9, (h) * 10 + 10, (h) * 10 + 11,  \
+    (h) * 10 + 12, (h) * 10 + 13, (h) * 10 + 14, (h) * 10 + 15
+
+/** Ten encoded BCD bytes with tens digit <tt>t</tt> */
+#define DS3231_BIN_ROW(t)                                                                   \
+    (t) << 4 | 0, (t) << 4 | 1, (t) << 4 | 2, (t) << 4 | 3, (t) << 4 | 4, (t) << 4 | 5,     \
+    (t) << 4 | 6, (t) << 4 | 7, (t) << 4 | 8, (t) << 4 | 9
+
+const u8 ds3231_bcd_to_bin[256] = {
+    DS3231_BCD_ROW(0), DS3231_BCD_ROW(1), DS3231_BCD_ROW(2), DS3231_BCD_ROW(3),
+    DS3231_BCD_ROW(4), DS3231_BCD_ROW(5), DS3231_BCD_ROW(6), DS3231_BCD_ROW(7),
+    DS3231_BCD_ROW(8), DS3231_BCD_ROW(9), DS3231_BCD_ROW(10), DS3231_BCD_ROW(11),
+    DS3231_BCD_ROW(12), DS3231_BCD_ROW(13), DS3231_BCD_ROW(14), DS3231_BCD_ROW(15),
+};
+
+const u8 ds3231_bin_to_bcd[100] = {
+    DS3231_BIN_ROW(0), DS3231_BIN_ROW(1), DS3231_BIN_ROW(2), DS3231_BIN_ROW(3), DS3231_BIN_ROW(4),
+    DS3231_BIN_ROW(5), DS3231_BIN_ROW(6), DS3231_BIN_ROW(7), DS3231_BIN_ROW(8), DS3231_BIN_ROW(9),
+};
+
+/** The number of days in each month of a common year */
+static const u8 ds3231_month_days_table[12] = {31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+
+/** Check the conversions against a reference calendar when an emulated chip is probed */
+static bool codec_selftest;
+module_param(codec_selftest, bool, 0444);
+MODULE_PARM_DESC(codec_selftest, "Check every day of 2000-2199 and every BCD byte through the register conversions when an emulated chip is probed and log the timing");
+
+/** Seconds of 2000-01-01 00:00:00 since the epoch, a saturday */
+#define DS3231_SELFTEST_EPOCH 946684800LL
+/** Number of days from 2000-01-01 to 2199-12-31 */
+#define DS3231_SELFTEST_DAYS 73049
+
+
+void ds3231_encode_time(const ds3231_time_t *time, u8 *regs)
+{
+    unsigned int century = time->year >= 2100;
+
+    regs[DS3231_REG_SECONDS] = ds3231_bin2bcd(time->second);
+    regs[DS3231_REG_MINUTES] = ds3231_bin2bcd(time->minute);
+    regs[DS3231_REG_HOURS] = ds3231_bin2bcd(time->hour);
+    regs[DS3231_REG_DAY] = time->weekday;
+    regs[DS3231_REG_DATE] = ds3231_bin2bcd(time->day);
+    regs[DS3231_REG_MONTH] = ds3231_bin2bcd(time->month) | (century ? DS3231_MASK_CENTURY : 0);
+    regs[DS3231_REG_YEAR] = ds3231_bin2bcd(time->year - 2000 - 100 * century);
+}
+
+
+void ds3231_decode_time(const u8 *regs, ds3231_time_t *time)
+{
+    u8 mon = regs[DS3231_REG_MONTH];
+
+    time->second = ds3231_bcd2bin(regs[DS3231_REG_SECONDS] & (DS3231_MASK_10_SECONDS | DS3231_MASK_SECONDS));
+    time->minute = ds3231_bcd2bin(regs[DS3231_REG_MINUTES] & (DS3231_MASK_10_MINUTES | DS3231_MASK_MINUTES));
+    time->hour = ds3231_bcd2bin(regs[DS3231_REG_HOURS] & (DS3231_MASK_20_HOUR | DS3231_MASK_10_HOUR | DS3231_MASK_HOUR));
+    time->weekday = regs[DS3231_REG_DAY] & DS3231_MASK_DAY;
+    time->day = ds3231_bcd2bin(regs[DS3231_REG_DATE] & (DS3231_MASK_10_DATE | DS3231_MASK_DATE));
+    time->month = ds3231_bcd2bin(mon & (DS3231_MASK_10_MONTH | DS3231_MASK_MONTH));
+    time->year = 2000 + ((mon & DS3231_MASK_CENTURY) ? 100 : 0) + ds3231_bcd2bin(regs[DS3231_REG_YEAR]);
+}
+
+
+unsigned int ds3231_month_days(unsigned int year, unsigned int month)
+{
+    /* Gregorian rule: 2100 is not a leap year, 2000 is */
+    bool leap = (year % 4 == 0 && year % 100 != 0) || year % 400 == 0;
+
+    return ds3231_month_days_table[month - 1] + (month == 2 && leap);
+}
+
+
+u8 ds3231_weekday(unsigned int year, unsigned int month, unsigned int day)
+{
+    /* 1970-01-01 was a thursday */
+    u32 wday = (u32)((div_u64(mktime64(year, month, day, 0, 0, 0), 24 * 60 * 60) + 4) % 7);
+
+    return wday == 0 ? 7 : wday;
+}
+
+
+time64_t ds3231_time_to_secs(const ds3231_time_t *time)
+{
+    return mktime64(time->year, time->month, time->day, time->hour, time->minute, time->second);
+}
+
+
+void ds3231_secs_to_time(time64_t secs, ds3231_time_t *time)
+{
+    struct tm tm;
+
+    time64_to_tm(secs, 0, &tm);
+    time->second = tm.tm_sec;
+    time->minute = tm.tm_min;
+    time->hour = tm.tm_hour;
+    time->weekday = tm.tm_wday == 0 ? 7 : tm.tm_wday;
+    time->day = tm.tm_mday;
+    time->month = tm.tm_mon + 1;
+    time->year = tm.tm_year + 1900;
+}
+
+
+void ds3231_time_to_rtc(const ds3231_time_t *time, struct rtc_time *tm)
+{
+    memset(tm, 0, sizeof(*tm));
+    tm->tm_sec = time->second;
+    tm->tm_min = time->minute;
+    tm->tm_hour = time->hour;
+    tm->tm_mday = time->day;
+    tm->tm_mon = time->month - 1;
+    tm->tm_year = time->year - 1900;
+    tm->tm_wday = time->weekday % 7;
+    tm->tm_yday = rtc_year_days(time->day, time->month - 1, time->year);
+}
+
+
+int ds3231_rtc_to_time(const struct rtc_time *tm, ds3231_time_t *time)
+{
+    if (rtc_valid_tm((struct rtc_time *)tm) < 0) {
+        return -EINVAL;
+    }
+
+    if (tm->tm_year < 2000 - 1900 || tm->tm_year > 2199 - 1900) {
+        return -EOVERFLOW;
+    }
+
+    time->second = tm->tm_sec;
+    time->minute = tm->tm_min;
+    time->hour = tm->tm_hour;
+    time->day = tm->tm_mday;
+    time->month = tm->tm_mon + 1;
+    time->year = tm->tm_year + 1900;
+    return 0;
+}
+
+
+/** Returns true if both times have the same fields */
+static bool ds3231_selftest_same(const ds3231_time_t *a, const ds3231_time_t *b)
+{
+    return a->second == b->second && a->minute == b->minute && a->hour == b->hour &&
+        a->weekday == b->weekday && a->day == b->day && a->month == b->month && a->year == b->year;
+}
+
+
+/**
+ * Checks one point in time through every conversion. <tt>ref</tt> comes from a calendar walked
+ * day by day, <tt>secs</tt> from counting seconds, so neither depends on the code under test.
+ *
+ * @return <tt>0</tt> if all conversions agree and <tt>-EINVAL</tt> otherwise.
+ */
+static int ds3231_selftest_time(const ds3231_time_t *ref, time64_t secs)
+{
+    u8 regs[DS3231_NUM_TIME_REGS];
+    ds3231_time_t time;
+    unsigned int century = ref->year >= 2100;
+
+    ds3231_secs_to_time(secs, &time);
+    if (!ds3231_selftest_same(&time, ref) || ds3231_time_to_secs(ref) != secs ||
+        ds3231_weekday(ref->year, ref->month, ref->day) != ref->weekday) {
+        goto fail;
+    }
+
+    ds3231_encode_time(ref, regs);
+    if (regs[DS3231_REG_SECONDS] != bin2bcd(ref->second) || regs[DS3231_REG_MINUTES] != bin2bcd(ref->minute) ||
+        regs[DS3231_REG_HOURS] != bin2bcd(ref->hour) || regs[DS3231_REG_DAY] != ref->weekday ||
+        regs[DS3231_REG_DATE] != bin2bcd(ref->day) ||
+        regs[DS3231_REG_MONTH] != (bin2bcd(ref->month) | (century ? DS3231_MASK_CENTURY : 0)) ||
+        regs[DS3231_REG_YEAR] != bin2bcd(ref->year - 2000 - 100 * century)) {
+        goto fail;
+    }
+
+    ds3231_decode_time(regs, &time);
+    if (!ds3231_selftest_same(&time, ref)) {
+        goto fail;
+    }
+
+    return 0;
+
+fail:
+    pr_err("ds3231: codec self-test failed at %04u-%02u-%02u %02u:%02u:%02u (%lld)\n",
+           ref->year, ref->month, ref->day, ref->hour, ref->minute, ref->second, (long long)secs);
+    return -EINVAL;
+}
+
+
+/** Logs the duration of a self-test pass over <tt>count</tt> conversions */
+static void ds3231_selftest_report(const char *name, ktime_t start, unsigned int count)
+{
+    s64 elapsed = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+    pr_info("ds3231: codec self-test: %u %s in %lld us (%lld ns each)\n",
+            count, name, div_s64(elapsed, NSEC_PER_USEC), div_s64(elapsed, count));
+}
+
+
+int ds3231_codec_selftest(void)
+{
+    static const u8 common[12] = {31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+    ds3231_time_t ref = {.year = 2000, .month = 1, .day = 1, .weekday = 6};
+    time64_t day_secs = DS3231_SELFTEST_EPOCH;
+    unsigned int i, tod, last;
+    ktime_t start;
+
+    if (!codec_selftest) {
+        return 0;
+    }
+
+    /* Every BCD byte, including the ones with nibbles above 9 */
+    start = ktime_get();
+    for (i = 0; i < 256; i++) {
+        if (ds3231_bcd2bin(i) != (i >> 4) * 10 + (i & 0x0f) || (i < 100 && ds3231_bcd2bin(ds3231_bin2bcd(i)) != i) ||
+            (i < 100 && ds3231_bin2bcd(i) != bin2bcd(i))) {
+            pr_err("ds3231: codec self-test failed at BCD byte 0x%02x\n", i);
+            return -EINVAL;
+        }
+    }
+    ds3231_selftest_report("BCD bytes", start, 256);
+
+    /* Every day, each at a different time of day, so all hours, minutes and seconds come up */
+    start = ktime_get();
+    for (i = 0; i < DS3231_SELFTEST_DAYS; i++) {
+        tod = (i * 7919) % (24 * 60 * 60);
+        ref.hour = tod / 3600;
+        ref.minute = tod / 60 % 60;
+        ref.second = tod % 60;
+        if (ds3231_selftest_time(&ref, day_secs + tod) < 0) {
+            return -EINVAL;
+        }
+
+        last = common[ref.month - 1] +
+            (ref.month == 2 && ((ref.year % 4 == 0 && ref.year % 100 != 0) || ref.year % 400 == 0));
+        if (ds3231_month_days(ref.year, ref.month) != last) {
+            pr_err("ds3231: codec self-test failed at the length of %04u-%02u\n", ref.year, ref.month);
+            return -EINVAL;
+        }
+
+        /* Walk the reference calendar to the next day */
+        day_secs += 24 * 60 * 60;
+        ref.weekday = ref.weekday % 7 + 1;
+        if (++ref.day > last) {
+            ref.day = 1;
+            if (++ref.month > 12) {
+                ref.month = 1;
+                ref.year++;
+            }
+        }
+
+        if ((i & 0x3ff) == 0) {
+            cond_resched();
+        }
+    }
+    ds3231_selftest_report("days", start, DS3231_SELFTEST_DAYS);
+
+    if (ref.year != 2200 || ref.month != 1 || ref.day != 1) {
+        pr_err("ds3231: codec self-test walked to %04u-%02u-%02u instead of 2200-01-01\n", ref.year, ref.month, ref.day);
+        return -EINVAL;
+    }
+
+    /* Every second of the last day before the century bit, 36524 days after 2000-01-01 */
+    ref = (ds3231_time_t){.year = 2099, .month = 12, .day = 31, .weekday = 4};
+    day_secs = DS3231_SELFTEST_EPOCH + 36524LL * 24 * 60 * 60;
+    start = ktime_get();
+    for (tod = 0; tod < 24 * 60 * 60; tod++) {
+        ref.hour = tod / 3600;
+        ref.minute = tod / 60 % 60;
+        ref.second = tod % 60;
+        if (ds3231_selftest_time(&ref, day_secs + tod) < 0) {
+            return -EINVAL;
+        }
+    }
+    ds3231_selftest_report("seconds", start, 24 * 60 * 60);
+
+    pr_info("ds3231: codec self-test passed\n");
+    return 0;
+}
@@ -0,0 +1,183 @@
+/*******************************************************
+ * ( ) ds3231_hw.c     :: Hardware interfacing         *
+ * ( ) ds3231_health.c :: Bus error recovery           *
+ * ( ) ds3231_codec.c  :: Register conversion          *
+ * ( ) ds3231_emul.c   :: Emulated register model      *
+ * ( ) ds3231_sync.c   :: Second-aligned time setting  *
+ * ( ) ds3231_page.c   :: Shared time page             *
+ * ( ) ds3231_irq.c    :: Interrupt handling           *
+ * ( ) ds3231_timer.c  :: Alarm timer multiplexing     *
+ * ( ) ds3231_temp.c   :: Temperature sampling         *
+ * ( ) ds3231_calib.c  :: Aging offset calibration     *
+ * (*) ds3231_debug.c  :: Tracing and statistics       *
+ * ( ) ds3231_io.c     :: Character device interfacing *
+ * ( ) ds3231_rtc.c    :: RTC class interfacing        *
+ * ( ) ds3231_mod.c    :: Linux module handling        *
+ *******************************************************/
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/log2.h>
+
+#include "ds3231.h"
+
+#define CREATE_TRACE_POINTS
+#include "ds3231_trace.h"
+
+/** Root directory of the driver in debugfs (<tt>null</tt> or an error pointer if debugfs is unavailable) */
+static struct dentry *ds3231_debugfs_root;
+
+/** Names of the DS3231_OP_* operations in the statistics */
+static const char *const ds3231_op_names[DS3231_NUM_OPS] = {
+    [DS3231_OP_PROBE] = "probe",
+    [DS3231_OP_READ_TIME] = "read_time",
+    [DS3231_OP_WRITE_TIME] = "write_time",
+    [DS3231_OP_READ_STATUS] = "read_status",
+    [DS3231_OP_READ_SNAPSHOT] = "read_snapshot",
+    [DS3231_OP_READ_TEMP] = "read_temp",
+    [DS3231_OP_GET_TIME] = "get_time",
+};
+
+
+ktime_t ds3231_op_begin(ds3231_status_t *chip, int op)
+{
+    trace_ds3231_op_begin(&chip->client->dev, op);
+    return ktime_get();
+}
+
+
+int ds3231_op_end(ds3231_status_t *chip, int op, ktime_t start, int result)
+{
+    s64 latency = ktime_to_ns(ktime_sub(ktime_get(), start));
+    u64 us = div_u64(latency, NSEC_PER_USEC);
+    ds3231_op_stats_t *stats = &chip->stats[op];
+
+    trace_ds3231_op_end(&chip->client->dev, op, result, latency);
+
+    spin_lock(&chip->stats_lock);
+    stats->count++;
+    if (result < 0) {
+        stats->errors++;
+    }
+    stats->total_ns += latency;
+    stats->max_ns = max_t(u64, stats->max_ns, latency);
+    stats->hist[us == 0 ? 0 : min_t(unsigned int, ilog2(us), DS3231_LAT_BUCKETS - 1)]++;
+    spin_unlock(&chip->stats_lock);
+
+    return result;
+}
+
+
+int ds3231_reject_busy(ds3231_status_t *chip)
+{
+    trace_ds3231_busy(&chip->client->dev);
+
+    spin_lock(&chip->stats_lock);
+    chip->busy_rejections++;
+    spin_unlock(&chip->stats_lock);
+    return -EBUSY;
+}
+
+
+/** Prints the statistics of a chip to its <tt>stats</tt> file in debugfs */
+static int ds3231_debug_show(struct seq_file *s, void *unused)
+{
+    ds3231_status_t *chip = s->private;
+    ds3231_op_stats_t stats[DS3231_NUM_OPS];
+    u32 busy, retries, recoveries, failures, stale;
+    int op, i;
+
+    /* Print from a copy, seq_printf must not run under the spinlock */
+    spin_lock(&chip->stats_lock);
+    memcpy(stats, chip->stats, sizeof(stats));
+    busy = chip->busy_rejections;
+    retries = chip->health_retries;
+    recoveries = chip->health_recoveries;
+    failures = chip->health_failures;
+    stale = chip->health_stale_reads;
+    spin_unlock(&chip->stats_lock);
+
+    seq_printf(s, "health: %s\n", ds3231_health_name(READ_ONCE(chip->health)));
+    seq_printf(s, "retries: %u, bus recoveries: %u, failures: %u, stale reads: %u\n", retries, recoveries, failures, stale);
+    seq_printf(s, "busy rejections: %u\n\n", busy);
+    seq_printf(s, "%-14s %10s %10s %10s %10s\n", "operation", "count", "errors", "avg_us", "max_us");
+    for (op = 0; op < DS3231_NUM_OPS; op++) {
+        seq_printf(s, "%-14s %10u %10u %10llu %10llu\n", ds3231_op_names[op], stats[op].count, stats[op].errors,
+                   stats[op].count == 0 ? 0 : div_u64(div_u64(stats[op].total_ns, stats[op].count), NSEC_PER_USEC),
+                   div_u64(stats[op].max_ns, NSEC_PER_USEC));
+    }
+
+    /* Bucket i counts latencies from 2^i up to 2^(i+1) microseconds, the last one everything above */
+    for (op = 0; op < DS3231_NUM_OPS; op++) {
+        if (stats[op].count == 0) {
+            continue;
+        }
+
+        seq_printf(s, "\n%s latency:\n", ds3231_op_names[op]);
+        for (i = 0; i < DS3231_LAT_BUCKETS; i++) {
+            if (stats[op].hist[i] == 0) {
+                continue;
+            }
+
+            if (i == DS3231_LAT_BUCKETS - 1) {
+                seq_printf(s, "  %8lu us and more   : %u\n", 1ul << i, stats[op].hist[i]);
+            } else {
+                seq_printf(s, "  %8lu us .. %8lu us: %u\n", i == 0 ? 0ul : 1ul << i, (2ul << i) - 1, stats[op].hist[i]);
+            }
+        }
+    }
+
+    return 0;
+}
+
+
+static int ds3231_debug_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, ds3231_debug_show, inode->i_private);
+}
+
+
+static const struct file_operations ds3231_debug_fops = {
+    .owner = THIS_MODULE,
+    .open = ds3231_debug_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+
+void ds3231_debug_init(void)
+{
+    ds3231_debugfs_root = debugfs_create_dir("ds3231", null);
+}
+
+
+void ds3231_debug_exit(void)
+{
+    debugfs_remove_recursive(ds3231_debugfs_root);
+    ds3231_debugfs_root = null;
+}
+
+
+void ds3231_debug_add(ds3231_status_t *chip)
+{
+    chip->debugfs = null;
+    if (IS_ERR_OR_NULL(ds3231_debugfs_root)) {
+        return;
+    }
+
+    chip->debugfs = debugfs_create_dir(dev_name(&chip->client->dev), ds3231_debugfs_root);
+    if (IS_ERR_OR_NULL(chip->debugfs)) {
+        pr_warn("ds3231: could not create debugfs directory\n");
+        chip->debugfs = null;
+        return;
+    }
+
+    debugfs_create_file("stats", 0444, chip->debugfs, chip, &ds3231_debug_fops);
+}
+
+
+void ds3231_debug_remove(ds3231_status_t *chip)
+{
+    debugfs_remove_recursive(chip->debugfs);
+    chip->debugfs = null;
+}
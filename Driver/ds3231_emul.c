@@ -0,0 +1,331 @@
+/*******************************************************
+ * ( ) ds3231_hw.c     :: Hardware interfacing         *
+ * ( ) ds3231_health.c :: Bus error recovery           *
+ * ( ) ds3231_codec.c  :: Register conversion          *
+ * (*) ds3231_emul.c   :: Emulated register model      *
+ * ( ) ds3231_sync.c   :: Second-aligned time setting  *
+ * ( ) ds3231_page.c   :: Shared time page             *
+ * ( ) ds3231_irq.c    :: Interrupt handling           *
+ * ( ) ds3231_timer.c  :: Alarm timer multiplexing     *
+ * ( ) ds3231_temp.c   :: Temperature sampling         *
+ * ( ) ds3231_calib.c  :: Aging offset calibration     *
+ * ( ) ds3231_debug.c  :: Tracing and statistics       *
+ * ( ) ds3231_io.c     :: Character device interfacing *
+ * ( ) ds3231_rtc.c    :: RTC class interfacing        *
+ * ( ) ds3231_mod.c    :: Linux module handling        *
+ *******************************************************/
+#include <linux/random.h>
+
+#include "ds3231.h"
+
+/** Talk to the register model instead of the chip */
+static bool emulate;
+module_param(emulate, bool, 0444);
+MODULE_PARM_DESC(emulate, "Emulate the DS3231 in software instead of accessing the chip (chips on i2c-stub are always emulated)");
+
+/** Latency added to every transfer of an emulated chip in microseconds */
+static unsigned int emul_latency_us;
+module_param(emul_latency_us, uint, 0644);
+MODULE_PARM_DESC(emul_latency_us, "Latency added to every transfer of an emulated chip in microseconds");
+
+/** Transfers of an emulated chip failing with <tt>-EIO</tt> per 1000 */
+static unsigned int emul_error_rate;
+module_param(emul_error_rate, uint, 0644);
+MODULE_PARM_DESC(emul_error_rate, "Transfers of an emulated chip failing with -EIO per 1000 transfers");
+
+/** Temperature measured by the conversions of an emulated chip in 1/4 °C steps */
+static int emul_temp = 25 * 4;
+module_param(emul_temp, int, 0644);
+MODULE_PARM_DESC(emul_temp, "Temperature measured by an emulated chip in 1/4 degree Celsius steps");
+
+/** Name of the adapter registered by the i2c-stub module */
+#define DS3231_EMUL_STUB_ADAPTER "SMBus stub driver"
+/** Duration of a temperature conversion (tCONV on page 3 of the DS3231 manual) */
+#define DS3231_EMUL_CONV_MS 200
+/** Interval of the automatic temperature conversions of the TCXO */
+#define DS3231_EMUL_TCXO_S 64
+/** Longest stretch of time the alarms are evaluated for when the model is updated */
+#define DS3231_EMUL_MAX_CATCHUP_S 86400
+
+/** Register model of an emulated chip */
+typedef struct _ds3231_emul
+{
+    struct mutex lock; /**< Serializes all accesses to the model */
+    u8 regs[DS3231_NUM_REGS]; /**< Register file; the time registers are rendered from <tt>now_ns</tt> on every update */
+    s64 now_ns; /**< Time of the emulated RTC at <tt>anchor</tt> in nanoseconds since the epoch */
+    ktime_t anchor; /**< Monotonic time of the last update of the model */
+    u8 converting; /**< Set to 1 while a temperature conversion runs */
+    ktime_t conv_end; /**< Monotonic time the running conversion finishes at */
+    ktime_t next_tcxo; /**< Monotonic time of the next automatic conversion */
+} ds3231_emul_t;
+
+
+/**
+ * Returns true if the alarm registers <tt>a</tt> match <tt>tm</tt>, honouring the A?M? mask bits
+ * and DY/DT. <tt>a</tt> starts with the seconds register for alarm 1 and with the minutes register
+ * for alarm 2, which always matches at second 0.
+ */
+static bool ds3231_emul_alarm_match(const u8 *a, bool has_seconds, const struct tm *tm)
+{
+    if (has_seconds) {
+        if (!(a[0] & DS3231_MASK_ALARM_MATCH) && ds3231_bcd2bin(a[0] & 0x7f) != tm->tm_sec) {
+            return false;
+        }
+        a++;
+    } else if (tm->tm_sec != 0) {
+        return false;
+    }
+
+    if (!(a[0] & DS3231_MASK_ALARM_MATCH) && ds3231_bcd2bin(a[0] & 0x7f) != tm->tm_min) {
+        return false;
+    }
+
+    if (!(a[1] & DS3231_MASK_ALARM_MATCH) && ds3231_bcd2bin(a[1] & 0x3f) != tm->tm_hour) {
+        return false;
+    }
+
+    if (a[2] & DS3231_MASK_ALARM_MATCH) {
+        return true;
+    }
+
+    if (a[2] & DS3231_MASK_DY_DT) {
+        return (a[2] & DS3231_MASK_DAY) == (tm->tm_wday == 0 ? 7 : tm->tm_wday);
+    }
+
+    return ds3231_bcd2bin(a[2] & 0x3f) == tm->tm_mday;
+}
+
+
+/** Renders <tt>secs</tt> into the time registers (24 hour mode) */
+static void ds3231_emul_render(ds3231_emul_t *emul, time64_t secs)
+{
+    ds3231_time_t time;
+
+    ds3231_secs_to_time(secs, &time);
+    ds3231_encode_time(&time, emul->regs);
+}
+
+
+/** Converts the time registers to seconds since the epoch (24 hour mode) */
+static time64_t ds3231_emul_decode(const u8 *regs)
+{
+    ds3231_time_t time;
+
+    ds3231_decode_time(regs, &time);
+    return ds3231_time_to_secs(&time);
+}
+
+
+/** Starts a temperature conversion, unless one is running already */
+static void ds3231_emul_start_conversion(ds3231_emul_t *emul, ktime_t now)
+{
+    if (emul->converting) {
+        return;
+    }
+
+    emul->converting = 1;
+    emul->conv_end = ktime_add_ms(now, DS3231_EMUL_CONV_MS);
+    emul->regs[DS3231_REG_STATUS] |= DS3231_MASK_BSY;
+}
+
+
+/** Finishes a temperature conversion with the temperature given by <tt>emul_temp</tt> */
+static void ds3231_emul_finish_conversion(ds3231_emul_t *emul)
+{
+    int temp = clamp(READ_ONCE(emul_temp), S8_MIN * 4, S8_MAX * 4 + 3);
+
+    emul->converting = 0;
+    emul->regs[DS3231_REG_TEMPMSB] = (u8)(temp >> 2);
+    emul->regs[DS3231_REG_TEMPLSB] = (u8)((temp & 3) << 6);
+    emul->regs[DS3231_REG_CONTROL] &= ~DS3231_MASK_CONV;
+    emul->regs[DS3231_REG_STATUS] &= ~DS3231_MASK_BSY;
+}
+
+
+/**
+ * Brings the model up to the current time: advances the time registers, sets the flags of
+ * alarms that matched since the last update and runs the temperature conversions.
+ * The caller has to hold <tt>emul->lock</tt>.
+ */
+static void ds3231_emul_update(ds3231_emul_t *emul)
+{
+    ktime_t now = ktime_get();
+    s64 elapsed = ktime_to_ns(ktime_sub(now, emul->anchor));
+    time64_t from = div_s64(emul->now_ns, NSEC_PER_SEC), to, secs;
+    struct tm tm;
+
+    /* One LSB of the aging offset slows the oscillator down by about 0.1 ppm */
+    emul->now_ns += elapsed - div_s64(elapsed * (s8)emul->regs[DS3231_REG_AGEINGOFFSET], 10000000);
+    emul->anchor = now;
+    to = div_s64(emul->now_ns, NSEC_PER_SEC);
+
+    /* Alarm flags are set whenever the alarm matches, whether its interrupt is enabled or not */
+    for (secs = max(from + 1, to - DS3231_EMUL_MAX_CATCHUP_S + 1); secs <= to; secs++) {
+        time64_to_tm(secs, 0, &tm);
+        if (ds3231_emul_alarm_match(&emul->regs[DS3231_REG_A1SECONDS], true, &tm)) {
+            emul->regs[DS3231_REG_STATUS] |= DS3231_MASK_A1F;
+        }
+        if (ds3231_emul_alarm_match(&emul->regs[DS3231_REG_A2MINUTES], false, &tm)) {
+            emul->regs[DS3231_REG_STATUS] |= DS3231_MASK_A2F;
+        }
+    }
+
+    ds3231_emul_render(emul, to);
+
+    if (emul->converting && !ktime_before(now, emul->conv_end)) {
+        ds3231_emul_finish_conversion(emul);
+    }
+
+    if (!ktime_before(now, emul->next_tcxo)) {
+        ds3231_emul_start_conversion(emul, now);
+        emul->next_tcxo = ktime_add_ms(now, DS3231_EMUL_TCXO_S * MSEC_PER_SEC);
+    }
+}
+
+
+/**
+ * Delays a transfer by <tt>emul_latency_us</tt> and fails it at a rate of <tt>emul_error_rate</tt>.
+ *
+ * @return <tt>0</tt> if the transfer goes through and <tt>-EIO</tt> otherwise.
+ */
+static int ds3231_emul_transfer(void)
+{
+    unsigned int latency = READ_ONCE(emul_latency_us);
+    unsigned int error_rate = READ_ONCE(emul_error_rate);
+
+    if (latency != 0) {
+        usleep_range(latency, latency + latency / 8 + 1);
+    }
+
+    if (error_rate != 0 && prandom_u32_max(1000) < error_rate) {
+        return -EIO;
+    }
+
+    return 0;
+}
+
+
+static int ds3231_emul_read_regs(ds3231_status_t *chip, u8 reg, u8 len, u8 *buf)
+{
+    ds3231_emul_t *emul = chip->emul;
+    int retval;
+
+    if (reg + len > DS3231_NUM_REGS) {
+        return -EINVAL;
+    }
+
+    RETURN_IF_LTZ(ds3231_emul_transfer(), retval);
+
+    mutex_lock(&emul->lock);
+    ds3231_emul_update(emul);
+    memcpy(buf, &emul->regs[reg], len);
+    mutex_unlock(&emul->lock);
+    return 0;
+}
+
+
+static int ds3231_emul_write_regs(ds3231_status_t *chip, u8 reg, u8 len, const u8 *buf)
+{
+    ds3231_emul_t *emul = chip->emul;
+    u8 keep, time_written = 0, seconds_written = 0;
+    s32 fraction;
+    int retval;
+    u8 i, r;
+
+    if (reg + len > DS3231_NUM_REGS) {
+        return -EINVAL;
+    }
+
+    RETURN_IF_LTZ(ds3231_emul_transfer(), retval);
+
+    mutex_lock(&emul->lock);
+    ds3231_emul_update(emul);
+
+    for (i = 0; i < len; i++) {
+        r = reg + i;
+        switch (r) {
+        case DS3231_REG_CONTROL:
+            /* CONV stays set until the conversion is complete */
+            emul->regs[r] = (buf[i] & ~DS3231_MASK_CONV) | (emul->regs[r] & DS3231_MASK_CONV);
+            if (buf[i] & DS3231_MASK_CONV) {
+                ds3231_emul_start_conversion(emul, emul->anchor);
+                emul->regs[r] |= DS3231_MASK_CONV;
+            }
+            break;
+
+        case DS3231_REG_STATUS:
+            /* OSF and the alarm flags can only be cleared, BSY is read-only */
+            keep = DS3231_MASK_OSF | DS3231_MASK_A2F | DS3231_MASK_A1F;
+            emul->regs[r] = (emul->regs[r] & buf[i] & keep) | (buf[i] & DS3231_MASK_EN32KHZ) | (emul->regs[r] & DS3231_MASK_BSY);
+            break;
+
+        case DS3231_REG_TEMPMSB:
+        case DS3231_REG_TEMPLSB:
+            break;
+
+        default:
+            emul->regs[r] = buf[i];
+            if (r < DS3231_NUM_TIME_REGS) {
+                time_written = 1;
+                seconds_written |= r == DS3231_REG_SECONDS;
+            }
+            break;
+        }
+    }
+
+    /* Writing the seconds register restarts the countdown of the current second */
+    if (time_written) {
+        div_s64_rem(emul->now_ns, NSEC_PER_SEC, &fraction);
+        emul->now_ns = ds3231_emul_decode(emul->regs) * NSEC_PER_SEC + (seconds_written ? 0 : fraction);
+        ds3231_emul_render(emul, div_s64(emul->now_ns, NSEC_PER_SEC));
+    }
+
+    mutex_unlock(&emul->lock);
+    return 0;
+}
+
+
+/** The model is updated under its lock, so multi-register reads are never torn */
+static bool ds3231_emul_atomic_read(ds3231_status_t *chip)
+{
+    return true;
+}
+
+
+/** Register access of an emulated chip */
+static const ds3231_bus_ops_t ds3231_emul_bus_ops = {
+    .read_regs = ds3231_emul_read_regs,
+    .write_regs = ds3231_emul_write_regs,
+    .atomic_read = ds3231_emul_atomic_read,
+};
+
+
+int ds3231_emul_attach(ds3231_status_t *chip)
+{
+    struct i2c_client *client = chip->client;
+    ds3231_emul_t *emul;
+
+    if (!emulate && strcmp(client->adapter->name, DS3231_EMUL_STUB_ADAPTER) != 0) {
+        return 0;
+    }
+
+    emul = devm_kzalloc(&client->dev, sizeof(*emul), GFP_KERNEL);
+    if (emul == null) {
+        return -ENOMEM;
+    }
+
+    /* Power-on state: oscillator stopped, 32 kHz output and alarm interrupts on INT/SQW, 2000-01-01 */
+    mutex_init(&emul->lock);
+    emul->regs[DS3231_REG_CONTROL] = DS3231_MASK_RS2 | DS3231_MASK_RS1 | DS3231_MASK_INTCN;
+    emul->regs[DS3231_REG_STATUS] = DS3231_MASK_OSF | DS3231_MASK_EN32KHZ;
+    emul->now_ns = mktime64(2000, 1, 1, 0, 0, 0) * NSEC_PER_SEC;
+    emul->anchor = ktime_get();
+    emul->next_tcxo = ktime_add_ms(emul->anchor, DS3231_EMUL_TCXO_S * MSEC_PER_SEC);
+    ds3231_emul_finish_conversion(emul);
+    ds3231_emul_render(emul, div_s64(emul->now_ns, NSEC_PER_SEC));
+
+    chip->emul = emul;
+    chip->bus = &ds3231_emul_bus_ops;
+    pr_info("ds3231: emulating chip %s\n", dev_name(&client->dev));
+    return 0;
+}
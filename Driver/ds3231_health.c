@@ -0,0 +1,180 @@
+/*******************************************************
+ * ( ) ds3231_hw.c     :: Hardware interfacing         *
+ * (*) ds3231_health.c :: Bus error recovery           *
+ * ( ) ds3231_codec.c  :: Register conversion          *
+ * ( ) ds3231_emul.c   :: Emulated register model      *
+ * ( ) ds3231_sync.c   :: Second-aligned time setting  *
+ * ( ) ds3231_page.c   :: Shared time page             *
+ * ( ) ds3231_irq.c    :: Interrupt handling           *
+ * ( ) ds3231_timer.c  :: Alarm timer multiplexing     *
+ * ( ) ds3231_temp.c   :: Temperature sampling         *
+ * ( ) ds3231_calib.c  :: Aging offset calibration     *
+ * ( ) ds3231_debug.c  :: Tracing and statistics       *
+ * ( ) ds3231_io.c     :: Character device interfacing *
+ * ( ) ds3231_rtc.c    :: RTC class interfacing        *
+ * ( ) ds3231_mod.c    :: Linux module handling        *
+ *******************************************************/
+#include "ds3231.h"
+
+/** Maximum number of retries of a failed register transfer */
+static unsigned int retry_max = 3;
+module_param(retry_max, uint, 0644);
+MODULE_PARM_DESC(retry_max, "Retry a failed register transfer up to retry_max times (0 = fail on the first error)");
+
+/** Time budget of a register transfer including all retries in microseconds */
+static unsigned int retry_deadline_us = 20000;
+module_param(retry_deadline_us, uint, 0644);
+MODULE_PARM_DESC(retry_deadline_us, "Give up retrying a register transfer once retry_deadline_us microseconds have passed since the first attempt");
+
+/** Delay before the first retry in microseconds, doubled for every further retry */
+static unsigned int retry_backoff_us = 500;
+module_param(retry_backoff_us, uint, 0644);
+MODULE_PARM_DESC(retry_backoff_us, "Wait retry_backoff_us microseconds before the first retry and twice as long before every further one");
+
+/** Age of the last successful transfer up to which reads are answered from the shared time page while recovering */
+static unsigned int stale_max_s = 60;
+module_param(stale_max_s, uint, 0644);
+MODULE_PARM_DESC(stale_max_s, "While the chip is unreachable, answer reads with the extrapolated time for up to stale_max_s seconds (0 = never)");
+
+/** Number of consecutive clean transfers after which a degraded chip is healthy again */
+#define DS3231_HEALTH_STREAK 32
+
+/** Names of the DS3231_HEALTH_* states */
+static const char *const ds3231_health_names[] = {
+    [DS3231_HEALTH_OK] = "ok",
+    [DS3231_HEALTH_DEGRADED] = "degraded",
+    [DS3231_HEALTH_RECOVERING] = "recovering",
+};
+
+
+/** Returns true for errors a glitch on the bus can cause, as opposed to the chip being gone or a bad request */
+static bool ds3231_health_transient(int error)
+{
+    switch (error) {
+    case -EIO:
+    case -EREMOTEIO:
+    case -ENXIO:
+    case -EAGAIN:
+    case -ETIMEDOUT:
+    case -EPROTO:
+        return true;
+    default:
+        return false;
+    }
+}
+
+
+/** Moves the chip into <tt>state</tt> and logs the transition */
+static void ds3231_health_set(ds3231_status_t *chip, u8 state)
+{
+    if (chip->health == state) {
+        return;
+    }
+
+    if (state == DS3231_HEALTH_OK) {
+        pr_info("ds3231: %s is %s again\n", dev_name(&chip->client->dev), ds3231_health_names[state]);
+    } else {
+        pr_warn("ds3231: %s is %s\n", dev_name(&chip->client->dev), ds3231_health_names[state]);
+    }
+
+    WRITE_ONCE(chip->health, state);
+    chip->health_streak = 0;
+}
+
+
+/** Updates the health state with the outcome of a transfer that took <tt>retries</tt> retries */
+static void ds3231_health_account(ds3231_status_t *chip, int retval, unsigned int retries)
+{
+    if (retval < 0) {
+        spin_lock(&chip->stats_lock);
+        chip->health_failures++;
+        spin_unlock(&chip->stats_lock);
+        ds3231_health_set(chip, DS3231_HEALTH_RECOVERING);
+        return;
+    }
+
+    chip->health_last_ok = ktime_get();
+    if (retries != 0 || chip->health == DS3231_HEALTH_RECOVERING) {
+        ds3231_health_set(chip, DS3231_HEALTH_DEGRADED);
+        chip->health_streak = 0;
+    } else if (chip->health == DS3231_HEALTH_DEGRADED && ++chip->health_streak >= DS3231_HEALTH_STREAK) {
+        ds3231_health_set(chip, DS3231_HEALTH_OK);
+    }
+}
+
+
+int ds3231_health_xfer(ds3231_status_t *chip, bool write, u8 reg, u8 len, u8 *buf)
+{
+    ktime_t start = ktime_get();
+    unsigned int retries = 0, backoff = READ_ONCE(retry_backoff_us);
+    s64 deadline = (s64)READ_ONCE(retry_deadline_us) * NSEC_PER_USEC;
+    int retval;
+
+    for (;;) {
+        if (write) {
+            retval = chip->bus->write_regs(chip, reg, len, buf);
+        } else {
+            retval = chip->bus->read_regs(chip, reg, len, buf);
+        }
+
+        if (retval >= 0 || !ds3231_health_transient(retval) || retries >= READ_ONCE(retry_max)) {
+            break;
+        }
+
+        /* Never start a retry whose backoff alone would overrun the deadline */
+        if (ktime_to_ns(ktime_sub(ktime_get(), start)) + (s64)backoff * NSEC_PER_USEC > deadline) {
+            break;
+        }
+
+        /* A second failure in a row may be a slave holding SDA low: clock it free */
+        if (retries == 1 && chip->bus->recover != null && chip->bus->recover(chip) == 0) {
+            spin_lock(&chip->stats_lock);
+            chip->health_recoveries++;
+            spin_unlock(&chip->stats_lock);
+        }
+
+        usleep_range(backoff, backoff + backoff / 2);
+        backoff = min(backoff * 2, READ_ONCE(retry_deadline_us));
+        retries++;
+    }
+
+    if (retries != 0) {
+        spin_lock(&chip->stats_lock);
+        chip->health_retries += retries;
+        spin_unlock(&chip->stats_lock);
+    }
+
+    ds3231_health_account(chip, retval, retries);
+    return retval;
+}
+
+
+int ds3231_health_stale_time(ds3231_status_t *chip, ds3231_time_t *time, int error)
+{
+    time64_t secs;
+    u32 nsec;
+
+    if (chip->health != DS3231_HEALTH_RECOVERING || error == -ENODEV || error == -EAGAIN) {
+        return error;
+    }
+
+    if (ktime_to_ns(ktime_sub(ktime_get(), chip->health_last_ok)) > (s64)READ_ONCE(stale_max_s) * NSEC_PER_SEC) {
+        return error;
+    }
+
+    if (ds3231_page_read_time(chip, &secs, &nsec) == DS3231_TS_NONE) {
+        return error;
+    }
+
+    ds3231_secs_to_time(secs, time);
+    spin_lock(&chip->stats_lock);
+    chip->health_stale_reads++;
+    spin_unlock(&chip->stats_lock);
+    return 0;
+}
+
+
+const char *ds3231_health_name(u8 state)
+{
+    return state < ARRAY_SIZE(ds3231_health_names) ? ds3231_health_names[state] : "unknown";
+}
@@ -1,30 +1,82 @@
-/****************************************************
- * (*) ds3231_hw.c  :: Hardware interfacing         *
- * ( ) ds3231_io.c  :: Character device interfacing *
- * ( ) ds3231_mod.c :: Linux module handling        *
- ****************************************************/
+/*******************************************************
+ * (*) ds3231_hw.c     :: Hardware interfacing         *
+ * ( ) ds3231_health.c :: Bus error recovery           *
+ * ( ) ds3231_codec.c  :: Register conversion          *
+ * ( ) ds3231_emul.c   :: Emulated register model      *
+ * ( ) ds3231_sync.c   :: Second-aligned time setting  *
+ * ( ) ds3231_page.c   :: Shared time page             *
+ * ( ) ds3231_irq.c    :: Interrupt handling           *
+ * ( ) ds3231_timer.c  :: Alarm timer multiplexing     *
+ * ( ) ds3231_temp.c   :: Temperature sampling         *
+ * ( ) ds3231_calib.c  :: Aging offset calibration     *
+ * ( ) ds3231_debug.c  :: Tracing and statistics       *
+ * ( ) ds3231_io.c     :: Character device interfacing *
+ * ( ) ds3231_rtc.c    :: RTC class interfacing        *
+ * ( ) ds3231_mod.c    :: Linux module handling        *
+ *******************************************************/
 #include "ds3231.h"
 
-/** The I2C client for interfacing with the DS3231 RTC */
-static struct i2c_client *ds3231_client;
+/** I2C bus the chip is instantiated on at <tt>0x68</tt> without firmware description (<tt>-1</tt> to disable) */
+static int i2c_bus = 1;
+module_param(i2c_bus, int, 0444);
+MODULE_PARM_DESC(i2c_bus, "I2C bus to instantiate a DS3231 at address 0x68 on (-1 = only bind to devices described by the device tree or ACPI)");
+
+/** The I2C client instantiated on <tt>i2c_bus</tt> or <tt>null</tt> */
+static struct i2c_client *ds3231_legacy_client;
+
+/** Re-sync interval of the time cache in milliseconds (<tt>0</tt> disables the cache) */
+static unsigned int cache_ms;
+module_param(cache_ms, uint, 0644);
+MODULE_PARM_DESC(cache_ms, "Serve reads from a time cache re-synced with the RTC every cache_ms milliseconds (0 = always read the RTC)");
+
+/** Output the 1 Hz square wave on INT/SQW (1) or use the pin as alarm interrupt (0) */
+static bool sqw = true;
+module_param(sqw, bool, 0444);
+MODULE_PARM_DESC(sqw, "Output the 1 Hz square wave on the INT/SQW pin (1) or use it as alarm interrupt (0)");
 
 /** RTC device ID */
 static const struct i2c_device_id ds3231_id[] = {
     {"ds3231_drv", 0},
+    {"ds3231", 0},
     {}};
 MODULE_DEVICE_TABLE(i2c, ds3231_id);
 
+/** Device tree match table (also used for ACPI through <tt>PRP0001</tt> and a <tt>compatible</tt> property) */
+static const struct of_device_id ds3231_of_match[] = {
+    {.compatible = "maxim,ds3231"},
+    {}};
+MODULE_DEVICE_TABLE(of, ds3231_of_match);
+
 /** RTC driver configuration */
 static struct i2c_driver ds3231_hw_driver = {
     .driver = {
         .owner = THIS_MODULE,
         .name = "ds3231_drv",
+        .of_match_table = of_match_ptr(ds3231_of_match),
     },
     .id_table = ds3231_id,
     .probe = ds3231_hw_probe,
     .remove = ds3231_hw_remove,
 };
 
+/** Returns true if the device tree describes an enabled DS3231, which the driver binds to without help */
+static bool ds3231_hw_described(void)
+{
+    struct device_node *node;
+    bool found = false;
+
+    for_each_matching_node(node, ds3231_of_match) {
+        if (of_device_is_available(node)) {
+            found = true;
+            of_node_put(node);
+            break;
+        }
+    }
+
+    return found;
+}
+
+
 int ds3231_hw_init(void)
 {
     const struct i2c_board_info info = {I2C_BOARD_INFO("ds3231_drv", 0x68)};
@@ -33,86 +85,284 @@ int ds3231_hw_init(void)
 
     pr_info("ds3231: initializing hardware ...\n");
 
-    /* Get the correct I2C adapter to use */
-    ds3231_client = null;
-    adapter = i2c_get_adapter(1);
-    if (adapter == null) {
-        pr_err("ds3231: i2c adapter not found\n");
-        return -ENODEV;
-    }
-
-    /* Open the correct I2C device */
-    ds3231_client = i2c_new_device(adapter, &info);
-    if (ds3231_client == null) {
-        pr_err("ds3231: failed to register i2c device\n");
-        return -ENODEV;
-    }
-
-    /* Register this as a driver */
+    /* Register this as a driver, which binds it to all chips described by the firmware */
     rval = i2c_add_driver(&ds3231_hw_driver);
     if (rval < 0) {
         pr_err("ds3231: failed to ds3231 i2c driver\n");
-        i2c_unregister_device(ds3231_client);
-        ds3231_client = null;
+        return rval;
+    }
+
+    /*
+     * Instantiate the chip on the configured bus for boards without firmware description. A chip
+     * the device tree already describes is bound by now and occupies its address, so the legacy
+     * client is skipped then; failing to create it is not fatal, the firmware chips still work.
+     */
+    ds3231_legacy_client = null;
+    if (i2c_bus >= 0 && ds3231_hw_described()) {
+        pr_info("ds3231: chips described by the device tree, not instantiating one on i2c bus %d\n", i2c_bus);
+    } else if (i2c_bus >= 0) {
+        adapter = i2c_get_adapter(i2c_bus);
+        if (adapter == null) {
+            pr_warn("ds3231: i2c adapter %d not found\n", i2c_bus);
+        } else {
+            ds3231_legacy_client = i2c_new_device(adapter, &info);
+            i2c_put_adapter(adapter);
+            if (ds3231_legacy_client == null) {
+                pr_warn("ds3231: failed to register i2c device on bus %d (address in use?)\n", i2c_bus);
+            }
+        }
     }
 
     pr_info("ds3231: hardware initialization completed.\n");
-    return rval;
+    return 0;
 }
 
 
 void ds3231_hw_exit(void)
 {
     pr_info("ds3231: uninitializing hardware ...\n");
-    if (ds3231_client != null)
+    if (ds3231_legacy_client != null)
     {
-    	/* Delete the driver and unregister the device. */
-        i2c_del_driver(&ds3231_hw_driver);
-        i2c_unregister_device(ds3231_client);
-        ds3231_client = null;
+        i2c_unregister_device(ds3231_legacy_client);
+        ds3231_legacy_client = null;
     }
+
+    /* Unbinds all remaining chips */
+    i2c_del_driver(&ds3231_hw_driver);
 }
 
 
-int ds3231_hw_probe(struct i2c_client *client, const struct i2c_device_id *id)
+/**
+ * Writes <tt>len</tt> consecutive registers starting at <tt>reg</tt> from <tt>buf</tt> over I2C.
+ * Uses a single auto-incrementing block transfer if the adapter supports it and falls
+ * back to writing the registers one by one otherwise.
+ *
+ * @return <tt>0</tt> on success and a kernel error code on failure.
+ */
+static int ds3231_i2c_write_regs(ds3231_status_t *chip, u8 reg, u8 len, const u8 *buf)
+{
+    int retval;
+    u8 i;
+
+    if (i2c_check_functionality(chip->client->adapter, I2C_FUNC_SMBUS_WRITE_I2C_BLOCK)) {
+        return i2c_smbus_write_i2c_block_data(chip->client, reg, len, buf);
+    }
+
+    for (i = 0; i < len; i++) {
+        RETURN_IF_LTZ(i2c_smbus_write_byte_data(chip->client, reg + i, buf[i]), retval);
+    }
+
+    return 0;
+}
+
+
+/**
+ * Reads <tt>len</tt> consecutive registers starting at <tt>reg</tt> into <tt>buf</tt> over I2C.
+ * Uses a single auto-incrementing block transfer if the adapter supports it and falls
+ * back to reading the registers one by one otherwise.
+ *
+ * @return <tt>0</tt> on success and a kernel error code on failure.
+ */
+static int ds3231_i2c_read_regs(ds3231_status_t *chip, u8 reg, u8 len, u8 *buf)
 {
     s32 data;
+    u8 i;
+
+    if (i2c_check_functionality(chip->client->adapter, I2C_FUNC_SMBUS_READ_I2C_BLOCK)) {
+        RETURN_IF_LTZ(i2c_smbus_read_i2c_block_data(chip->client, reg, len, buf), data);
+        return data == len ? 0 : -EIO;
+    }
+
+    for (i = 0; i < len; i++) {
+        RETURN_IF_LTZ(i2c_smbus_read_byte_data(chip->client, reg + i), data);
+        buf[i] = (u8)data;
+    }
+
+    return 0;
+}
+
+
+/** Block reads make the chip latch all registers at once; byte reads may be torn by an update */
+static bool ds3231_i2c_atomic_read(ds3231_status_t *chip)
+{
+    return i2c_check_functionality(chip->client->adapter, I2C_FUNC_SMBUS_READ_I2C_BLOCK);
+}
+
+
+/**
+ * Runs the bus recovery of the adapter (clocking SCL until a stuck slave releases SDA). Behind
+ * an I2C mux the channel is a virtual adapter, so the recovery runs on the root adapter that
+ * drives the lines.
+ *
+ * @return <tt>0</tt> on success, <tt>-EOPNOTSUPP</tt> if the adapter has no bus recovery and a
+ * kernel error code on failure.
+ */
+static int ds3231_i2c_recover(ds3231_status_t *chip)
+{
+    struct i2c_adapter *adapter = i2c_root_adapter(&chip->client->adapter->dev);
+    int retval;
+
+    if (adapter == null || adapter->bus_recovery_info == null) {
+        return -EOPNOTSUPP;
+    }
+
+    i2c_lock_bus(adapter, I2C_LOCK_ROOT_ADAPTER);
+    retval = i2c_recover_bus(adapter);
+    i2c_unlock_bus(adapter, I2C_LOCK_ROOT_ADAPTER);
+    return retval;
+}
+
+
+/** Register access of a real chip */
+static const ds3231_bus_ops_t ds3231_i2c_bus_ops = {
+    .read_regs = ds3231_i2c_read_regs,
+    .write_regs = ds3231_i2c_write_regs,
+    .atomic_read = ds3231_i2c_atomic_read,
+    .recover = ds3231_i2c_recover,
+};
+
+
+/**
+ * Writes <tt>len</tt> consecutive registers starting at <tt>reg</tt> from <tt>buf</tt>
+ * through the bus of the chip, retrying transient errors (see <tt>ds3231_health_xfer</tt>).
+ *
+ * @return <tt>0</tt> on success, <tt>-ENODEV</tt> if the chip was removed and a kernel error
+ * code on failure.
+ */
+static int ds3231_write_regs(ds3231_status_t *chip, u8 reg, u8 len, const u8 *buf)
+{
+    if (chip->removed) {
+        return -ENODEV;
+    }
+
+    return ds3231_health_xfer(chip, true, reg, len, (u8 *)buf);
+}
+
+
+int ds3231_read_regs(ds3231_status_t *chip, u8 reg, u8 len, u8 *buf)
+{
+    if (chip->removed) {
+        return -ENODEV;
+    }
+
+    return ds3231_health_xfer(chip, false, reg, len, buf);
+}
+
+
+/** Frees the state of a chip once the last reference is gone */
+static void ds3231_chip_release(struct kref *ref)
+{
+    ds3231_status_t *chip = container_of(ref, ds3231_status_t, ref);
+
+    /* Nothing may run on the chip any more once it is freed (remove already did this if the chip was set up) */
+    if (chip->work_ready) {
+        ds3231_calib_exit(chip);
+        ds3231_temp_exit(chip);
+    }
+
+    put_device(&chip->client->dev);
+    ds3231_page_free(chip);
+    kfree(chip);
+}
+
+
+void ds3231_chip_put(ds3231_status_t *chip)
+{
+    kref_put(&chip->ref, ds3231_chip_release);
+}
+
+
+/** Drops the reference of the I2C device once all managed resources of the chip are released */
+static void ds3231_chip_devm_put(void *data)
+{
+    ds3231_chip_put(data);
+}
+
+
+/**
+ * Allocates and initializes the state of a chip bound to <tt>client</tt>. The chip holds a
+ * reference to <tt>client</tt> so open file handles may outlive the removal of the device.
+ */
+static ds3231_status_t *ds3231_chip_alloc(struct i2c_client *client)
+{
+    ds3231_status_t *chip;
+
+    chip = kzalloc(sizeof(*chip), GFP_KERNEL);
+    if (chip == null) {
+        return null;
+    }
+
+    if (ds3231_page_alloc(chip) < 0) {
+        kfree(chip);
+        return null;
+    }
+
+    kref_init(&chip->ref);
+    chip->client = client;
+    chip->bus = &ds3231_i2c_bus_ops;
+    get_device(&client->dev);
+
+    mutex_init(&chip->lock);
+    spin_lock_init(&chip->read_lock);
+    init_waitqueue_head(&chip->read_wait);
+    init_waitqueue_head(&chip->tick_wait);
+    init_waitqueue_head(&chip->alarm_wait);
+    timerqueue_init_head(&chip->timers);
+    spin_lock_init(&chip->temp_lock);
+    init_waitqueue_head(&chip->conv_wait);
+    spin_lock_init(&chip->stats_lock);
+    chip->health = DS3231_HEALTH_OK;
+    chip->health_last_ok = ktime_get();
+    return chip;
+}
+
+
+/**
+ * Configures the chip and sets up its subsystems. See <tt>ds3231_hw_probe</tt>.
+ *
+ * @return <tt>0</tt> on success and a kernel error code on failure.
+ */
+static int ds3231_hw_setup(ds3231_status_t *chip)
+{
     u8 reg;
+    int retval;
 
     pr_info("ds3231: setting up RTC ...\n");
 
-    /* Disable Alarm 1, Alarm 2 and interrupts. Enable oscillator */
-    data = i2c_smbus_read_byte_data(client, DS3231_REG_CONTROL);
-    if (data < 0) {
+    /* Disable Alarm 1 and Alarm 2. Output the 1 Hz square wave or alarm interrupts on INT/SQW. Enable oscillator */
+    if (ds3231_read_regs(chip, DS3231_REG_CONTROL, 1, &reg) < 0) {
         goto failed_to_comm;
     }
 
-    reg = (u8)data;
-    if (reg & DS3231_MASK_A1IE || reg & DS3231_MASK_A2IE || reg & DS3231_MASK_INTCN || reg & DS3231_MASK_EOSC)
+    if (reg & DS3231_MASK_A1IE || reg & DS3231_MASK_A2IE || !(reg & DS3231_MASK_INTCN) != sqw || reg & DS3231_MASK_EOSC ||
+        reg & DS3231_MASK_RS1 || reg & DS3231_MASK_RS2)
     {
         reg &= ~DS3231_MASK_A1IE;
         reg &= ~DS3231_MASK_A2IE;
         reg &= ~DS3231_MASK_INTCN;
         reg &= ~DS3231_MASK_EOSC;
+        reg &= ~DS3231_MASK_RS1;
+        reg &= ~DS3231_MASK_RS2;
+        if (!sqw) {
+            reg |= DS3231_MASK_INTCN;
+        }
 
-        if (i2c_smbus_write_byte_data(client, DS3231_REG_CONTROL, reg) < 0) {
+        if (ds3231_write_regs(chip, DS3231_REG_CONTROL, 1, &reg) < 0) {
             goto failed_to_comm;
         }
 
-        pr_debug("ds3231: disabled alarm1, alarm2, interrupts; enabled oscillator.\n");
+        pr_debug("ds3231: disabled alarm1, alarm2; enabled %s and oscillator.\n", sqw ? "1 Hz square wave" : "alarm interrupts");
     }
 
     /* Check oscillator stop flag */
-    data = i2c_smbus_read_byte_data(client, DS3231_REG_STATUS);
-    if (data < 0) {
+    if (ds3231_read_regs(chip, DS3231_REG_STATUS, 1, &reg) < 0) {
         goto failed_to_comm;
     }
 
-    reg = (u8)data;
     if (reg & DS3231_MASK_OSF) {
         reg &= ~DS3231_MASK_OSF;
 
-        if (i2c_smbus_write_byte_data(client, DS3231_REG_STATUS, reg) < 0) {
+        if (ds3231_write_regs(chip, DS3231_REG_STATUS, 1, &reg) < 0) {
             goto failed_to_comm;
         }
 
@@ -120,22 +370,49 @@ int ds3231_hw_probe(struct i2c_client *client, const struct i2c_device_id *id)
     }
 
     /* Set the RTC to 24 hr mode */
-    data = i2c_smbus_read_byte_data(client, DS3231_REG_HOURS);
-    if (data < 0) {
+    if (ds3231_read_regs(chip, DS3231_REG_HOURS, 1, &reg) < 0) {
         goto failed_to_comm;
     }
 
-    reg = (u8)data;
     if (reg & DS3231_MASK_HOUR_SELECT) {
         reg &= ~DS3231_MASK_HOUR_SELECT;
 
-        if (i2c_smbus_write_byte_data(client, DS3231_REG_HOURS, reg) < 0){
+        if (ds3231_write_regs(chip, DS3231_REG_HOURS, 1, &reg) < 0){
             goto failed_to_comm;
         }
 
         pr_debug("ds3231: set to 24 hour format.\n");
     }
 
+    /* Make the RTC available to the kernel's time keeping */
+    if (ds3231_rtc_init(chip) < 0) {
+        pr_err("ds3231: failed to register with the rtc class\n");
+        return -ENODEV;
+    }
+
+    /* Take the square wave edges as interrupts (optional) */
+    if (ds3231_irq_init(chip) < 0) {
+        pr_warn("ds3231: continuing without square wave interrupt\n");
+    }
+
+    /* Sample the temperature in the background (optional) */
+    ds3231_temp_init(chip);
+
+    /* Trim the oscillator against the system clock (optional) */
+    ds3231_calib_init(chip);
+    chip->work_ready = 1;
+
+    /* Give the chip its own character device */
+    retval = ds3231_io_add(chip);
+    if (retval < 0) {
+        ds3231_calib_exit(chip);
+        ds3231_temp_exit(chip);
+        ds3231_irq_exit(chip);
+        return retval;
+    }
+
+    /* Only now, so a concurrent change of temp_period_ms either finds the chip or is seen here */
+    ds3231_temp_apply(chip);
     return 0;
 
 failed_to_comm:
@@ -143,107 +420,529 @@ failed_to_comm:
     return -ENODEV;
 }
 
+int ds3231_hw_probe(struct i2c_client *client, const struct i2c_device_id *id)
+{
+    ds3231_status_t *chip;
+    ktime_t start;
+    int retval;
+
+    /* Every chip gets its own state, released after all managed resources of the device */
+    chip = ds3231_chip_alloc(client);
+    if (chip == null) {
+        return -ENOMEM;
+    }
+
+    RETURN_IF_LTZ(devm_add_action_or_reset(&client->dev, ds3231_chip_devm_put, chip), retval);
+    i2c_set_clientdata(client, chip);
+    chip->sqw = sqw;
+    chip->alarm_enabled = 0;
+
+    /* Chips on i2c-stub or with the emulate parameter set talk to the register model instead */
+    RETURN_IF_LTZ(ds3231_emul_attach(chip), retval);
+    if (chip->emul != null) {
+        RETURN_IF_LTZ(ds3231_codec_selftest(), retval);
+    }
+
+    start = ds3231_op_begin(chip, DS3231_OP_PROBE);
+    retval = ds3231_hw_setup(chip);
+    if (retval == 0) {
+        ds3231_debug_add(chip);
+    }
+
+    return ds3231_op_end(chip, DS3231_OP_PROBE, start, retval);
+}
+
 int ds3231_hw_remove(struct i2c_client *client)
 {
+    ds3231_status_t *chip = i2c_get_clientdata(client);
+
     pr_err("ds3231: ds3231_remove called\n");
+
+    /*
+     * File handles that are still open fail from now on instead of touching the bus. This comes
+     * first, so they cannot queue new work while the work items are cancelled below.
+     */
+    mutex_lock(&chip->lock);
+    chip->removed = 1;
+    mutex_unlock(&chip->lock);
+
+    ds3231_debug_remove(chip);
+    ds3231_io_remove(chip);
+    ds3231_calib_exit(chip);
+    ds3231_temp_exit(chip);
+    ds3231_irq_exit(chip);
     return 0;
 }
 
-#define RETURN_IF_LTZ(x, y) \
-    y = x;                  \
-    if (y < 0) {            \
-        return y;           \
-    }
-
-int ds3231_write_time(ds3231_time_t *time)
+int ds3231_write_time_regs(ds3231_status_t *chip, const u8 *regs)
 {
-    u8 secs, mins, hrs, date, mon, year;
-    int retval;
+    ktime_t start;
 
-	/* Convert to binary. See "Timekeeping Registers" on page 11 of the DS3231 manual.*/
-    secs = ((time->second / 10) << 4) | (time->second % 10);
-    mins = ((time->minute / 10) << 4) | (time->minute % 10);
-    hrs = ((time->hour / 20) << 5) | (((time->hour % 20) / 10) << 4) | ((time->hour % 20) % 10);
-    date = ((time->day / 10) << 4) | (time->day % 10);
-    mon = ((time->year / 100) << 7) | ((time->month / 10) << 4) | ((time->month % 10));
-    year = (((time->year % 100) / 10) << 4) | ((time->year % 100) % 10);
+    start = ds3231_op_begin(chip, DS3231_OP_WRITE_TIME);
+
+    /* The cache anchor is stale as soon as we touch the time registers */
+    chip->cache_valid = 0;
+    chip->time_writes++;
+    ds3231_page_invalidate(chip);
 
     /* Write to the RTC */
-    RETURN_IF_LTZ(i2c_smbus_write_byte_data(ds3231_client, DS3231_REG_SECONDS, secs), retval);
-    RETURN_IF_LTZ(i2c_smbus_write_byte_data(ds3231_client, DS3231_REG_MINUTES, mins), retval);
-    RETURN_IF_LTZ(i2c_smbus_write_byte_data(ds3231_client, DS3231_REG_HOURS, hrs), retval);
-    RETURN_IF_LTZ(i2c_smbus_write_byte_data(ds3231_client, DS3231_REG_DATE, date), retval);
-    RETURN_IF_LTZ(i2c_smbus_write_byte_data(ds3231_client, DS3231_REG_MONTH, mon), retval);
-    RETURN_IF_LTZ(i2c_smbus_write_byte_data(ds3231_client, DS3231_REG_YEAR, year), retval);
+    return ds3231_op_end(chip, DS3231_OP_WRITE_TIME, start, ds3231_write_regs(chip, DS3231_REG_SECONDS, DS3231_NUM_TIME_REGS, regs));
+}
 
-    return retval;
+
+int ds3231_write_time(ds3231_status_t *chip, ds3231_time_t *time)
+{
+    u8 regs[DS3231_NUM_TIME_REGS];
+
+    /* Derive the day of the week and convert to BCD */
+    time->weekday = ds3231_weekday(time->year, time->month, time->day);
+    ds3231_encode_time(time, regs);
+    return ds3231_write_time_regs(chip, regs);
 }
 
 
-int ds3231_read_time(ds3231_time_t *time)
+/**
+ * Reads the <tt>len</tt> registers starting at <tt>DS3231_REG_SECONDS</tt> into <tt>regs</tt>.
+ * If the bus has no block read support the registers are read byte by byte and the read
+ * is repeated once if the seconds register changed in between, so a rollover cannot tear the
+ * time registers.
+ *
+ * @return <tt>0</tt> on success and a kernel error code on failure.
+ */
+static int ds3231_read_from_seconds(ds3231_status_t *chip, u8 len, u8 *regs)
 {
-    s32 reg_secs, reg_mins, reg_hrs, reg_date, reg_mon, reg_year;
-    u8 secs, mins, hrs, date, mon, year;
+    u8 reg_secs;
+    int retval;
 
-    /* Read from the RTC */
-    RETURN_IF_LTZ(i2c_smbus_read_byte_data(ds3231_client, DS3231_REG_SECONDS), reg_secs);
-    RETURN_IF_LTZ(i2c_smbus_read_byte_data(ds3231_client, DS3231_REG_MINUTES), reg_mins);
-    RETURN_IF_LTZ(i2c_smbus_read_byte_data(ds3231_client, DS3231_REG_HOURS), reg_hrs);
-    RETURN_IF_LTZ(i2c_smbus_read_byte_data(ds3231_client, DS3231_REG_DATE), reg_date);
-    RETURN_IF_LTZ(i2c_smbus_read_byte_data(ds3231_client, DS3231_REG_MONTH), reg_mon);
-    RETURN_IF_LTZ(i2c_smbus_read_byte_data(ds3231_client, DS3231_REG_YEAR), reg_year);
-
-    secs = (u8)reg_secs;
-    mins = (u8)reg_mins;
-    hrs = (u8)reg_hrs;
-    date = (u8)reg_date;
-    mon = (u8)reg_mon;
-    year = (u8)reg_year;
+    RETURN_IF_LTZ(ds3231_read_regs(chip, DS3231_REG_SECONDS, len, regs), retval);
 
-    /* Convert to decimal. See "Timekeeping Registers" on page 11 of the DS3231 manual.*/
-    time->second = 10 * (secs >> 4) + (secs & DS3231_MASK_SECONDS);
-    time->minute = 10 * (mins >> 4) + (mins & DS3231_MASK_MINUTES);
-    time->hour = 20 * ((hrs >> 5) & 1) + 10 * ((hrs >> 4) & 1) + (hrs & DS3231_MASK_HOUR);
-    time->day = 10 * (date >> 4) + (date & DS3231_MASK_DATE);
-    time->month = 10 * ((mon >> 4) & 1) + (mon & DS3231_MASK_MONTH);
-    time->year = 2000 + 100 * (mon >> 7) + 10 * (year >> 4) + (year & DS3231_MASK_YEAR);
+    if (!chip->bus->atomic_read(chip)) {
+        RETURN_IF_LTZ(ds3231_read_regs(chip, DS3231_REG_SECONDS, 1, &reg_secs), retval);
+        if (reg_secs != regs[DS3231_REG_SECONDS]) {
+            RETURN_IF_LTZ(ds3231_read_regs(chip, DS3231_REG_SECONDS, len, regs), retval);
+        }
+    }
 
     return 0;
 }
 
+/**
+ * Decodes the temperature registers (10-bit two's complement: integer part in
+ * TEMPMSB, quarter degrees in bits 7:6 of TEMPLSB) into 1/4 °C steps.
+ */
+static s16 ds3231_decode_temp(u8 msb, u8 lsb)
+{
+    return (s16)((s8)msb * 4) | (lsb >> 6);
+}
 
-int ds3231_read_status(void)
+/**
+ * Decodes the control, status, aging and temperature registers into the state of
+ * <tt>chip</tt>. <tt>regs</tt> has to hold the registers
+ * <tt>DS3231_REG_CONTROL</tt> to <tt>DS3231_REG_TEMPLSB</tt> in that order (only up to
+ * <tt>DS3231_REG_AGEINGOFFSET</tt> while the temperature sampler runs).
+ * If the OSF is set the oscillator is re-enabled and the OSF is cleared.
+ *
+ * @return <tt>0</tt> on success, <tt>-EAGAIN</tt> if the oscillator was stopped or
+ * a kernel error code if restarting the oscillator failed.
+ */
+static int ds3231_decode_status(ds3231_status_t *chip, const u8 *regs)
 {
-    s32 reg_status, reg_temp;
-    u8 status, control;
+    u8 control = regs[DS3231_REG_CONTROL - DS3231_REG_CONTROL];
+    u8 status = regs[DS3231_REG_STATUS - DS3231_REG_CONTROL];
     int retval = 0;
 
-    RETURN_IF_LTZ(i2c_smbus_read_byte_data(ds3231_client, DS3231_REG_STATUS), reg_status);    
-    status = (u8)reg_status;
-
-    if (!ds3231_status.drv_temp_test) {
-        RETURN_IF_LTZ(i2c_smbus_read_byte_data(ds3231_client, DS3231_REG_TEMPMSB), reg_temp);
-        ds3231_status.temp = (s8)reg_temp;
+    /* While the sampler runs it owns the temperature and the temperature registers are not read */
+    if (!chip->drv_temp_test && !chip->temp_sampling) {
+        chip->temp = ds3231_decode_temp(regs[DS3231_REG_TEMPMSB - DS3231_REG_CONTROL], regs[DS3231_REG_TEMPLSB - DS3231_REG_CONTROL]);
     }
 
-    ds3231_status.osf = (status >> 7);
-    ds3231_status.rtc_busy = ((status & DS3231_MASK_BSY) << 1);
+    chip->aging = (s8)regs[DS3231_REG_AGEINGOFFSET - DS3231_REG_CONTROL];
+    chip->osf = (status >> 7);
+    chip->rtc_busy = !!(status & DS3231_MASK_BSY);
+    ds3231_page_set_status(chip);
 
-    if (ds3231_status.osf)
+    if (chip->osf)
     {
         pr_notice("ds3231: oscillator stopped. restarting ...\n");
-        control = i2c_smbus_read_byte_data(ds3231_client, DS3231_REG_CONTROL);
-        RETURN_IF_LTZ(i2c_smbus_write_byte_data(ds3231_client, DS3231_REG_CONTROL, (control | DS3231_MASK_EOSC)), retval);
-        RETURN_IF_LTZ(i2c_smbus_write_byte_data(ds3231_client, DS3231_REG_STATUS, (status & (~DS3231_MASK_OSF))), retval);
+        control &= ~DS3231_MASK_EOSC;
+        status &= ~DS3231_MASK_OSF;
+        RETURN_IF_LTZ(ds3231_write_regs(chip, DS3231_REG_CONTROL, 1, &control), retval);
+        RETURN_IF_LTZ(ds3231_write_regs(chip, DS3231_REG_STATUS, 1, &status), retval);
         return -EAGAIN;
     }
 
-    if ((ds3231_status.temp > 85) || (ds3231_status.temp < -40))
+    if ((chip->temp > 85 * 4) || (chip->temp < -40 * 4))
     {
-        pr_notice("ds3231: temperature warning: %d°C\n", ds3231_status.temp);
+        pr_notice("ds3231: temperature warning: " DS3231_TEMP_FMT "°C\n", DS3231_TEMP_ARG(chip->temp));
     }
 
     /** Reset temperature test flag */
-    ds3231_status.drv_temp_test = 0;
+    chip->drv_temp_test = 0;
     return retval;
+}
+
+int ds3231_read_time(ds3231_status_t *chip, ds3231_time_t *time)
+{
+    u8 regs[DS3231_NUM_TIME_REGS];
+    ktime_t start;
+    int retval;
+
+    start = ds3231_op_begin(chip, DS3231_OP_READ_TIME);
+
+    /* Read from the RTC */
+    retval = ds3231_read_from_seconds(chip, sizeof(regs), regs);
+
+    /* Convert to decimal. See "Timekeeping Registers" on page 11 of the DS3231 manual.*/
+    if (retval == 0) {
+        ds3231_decode_time(regs, time);
+    }
+
+    return ds3231_op_end(chip, DS3231_OP_READ_TIME, start, retval);
+}
+
+
+int ds3231_read_status(ds3231_status_t *chip)
+{
+    u8 regs[DS3231_REG_TEMPLSB - DS3231_REG_CONTROL + 1];
+    ktime_t start;
+    int retval;
+
+    start = ds3231_op_begin(chip, DS3231_OP_READ_STATUS);
+    retval = ds3231_read_regs(chip, DS3231_REG_CONTROL, sizeof(regs), regs);
+    if (retval == 0) {
+        retval = ds3231_decode_status(chip, regs);
+    }
+
+    return ds3231_op_end(chip, DS3231_OP_READ_STATUS, start, retval);
+}
+
+
+int ds3231_read_snapshot(ds3231_status_t *chip, ds3231_time_t *time)
+{
+    u8 regs[DS3231_NUM_REGS];
+    ktime_t start;
+    int retval;
+
+    start = ds3231_op_begin(chip, DS3231_OP_READ_SNAPSHOT);
+
+    /* Read the whole register file in one burst (the temperature is left to the sampler if it runs) */
+    retval = ds3231_read_from_seconds(chip, chip->temp_sampling ? DS3231_REG_TEMPMSB : DS3231_NUM_REGS, regs);
+    if (retval == 0) {
+        retval = ds3231_decode_status(chip, regs + DS3231_REG_CONTROL);
+    }
+
+    if (retval == 0) {
+        ds3231_decode_time(regs, time);
+        ds3231_page_set_time(chip, ds3231_time_to_secs(time), start, ktime_get());
+    }
+
+    return ds3231_op_end(chip, DS3231_OP_READ_SNAPSHOT, start, retval);
+}
+
+
+int ds3231_read_temp(ds3231_status_t *chip, s16 *temp)
+{
+    u8 regs[2];
+    ktime_t start;
+    int retval;
+
+    start = ds3231_op_begin(chip, DS3231_OP_READ_TEMP);
+    retval = ds3231_read_regs(chip, DS3231_REG_TEMPMSB, sizeof(regs), regs);
+    if (retval == 0) {
+        *temp = ds3231_decode_temp(regs[0], regs[1]);
+    }
+
+    return ds3231_op_end(chip, DS3231_OP_READ_TEMP, start, retval);
+}
+
+
+int ds3231_start_conversion(ds3231_status_t *chip)
+{
+    u8 regs[2];
+    int retval;
+
+    RETURN_IF_LTZ(ds3231_read_regs(chip, DS3231_REG_CONTROL, sizeof(regs), regs), retval);
+
+    /* A conversion must not be started while the chip runs its own; the caller retries later */
+    if (regs[1] & DS3231_MASK_BSY) {
+        return -EBUSY;
+    }
+
+    regs[0] |= DS3231_MASK_CONV;
+    return ds3231_write_regs(chip, DS3231_REG_CONTROL, 1, regs);
+}
+
+
+int ds3231_read_conversion(ds3231_status_t *chip, s16 *temp)
+{
+    u8 regs[DS3231_REG_TEMPLSB - DS3231_REG_CONTROL + 1];
+    int retval;
+
+    RETURN_IF_LTZ(ds3231_read_regs(chip, DS3231_REG_CONTROL, sizeof(regs), regs), retval);
+
+    /* CONV stays set until the conversion is complete */
+    if (regs[0] & DS3231_MASK_CONV) {
+        return -EINPROGRESS;
+    }
+
+    *temp = ds3231_decode_temp(regs[DS3231_REG_TEMPMSB - DS3231_REG_CONTROL], regs[DS3231_REG_TEMPLSB - DS3231_REG_CONTROL]);
+    return 0;
+}
+
+
+int ds3231_adjust_aging(ds3231_status_t *chip, int delta)
+{
+    int aging, retval;
+    u32 seq;
+    u8 reg;
+
+    RETURN_IF_LTZ(ds3231_read_regs(chip, DS3231_REG_AGEINGOFFSET, 1, &reg), retval);
+
+    aging = clamp_t(int, (s8)reg + delta, S8_MIN, S8_MAX);
+    reg = (u8)aging;
+    RETURN_IF_LTZ(ds3231_write_regs(chip, DS3231_REG_AGEINGOFFSET, 1, &reg), retval);
+    chip->aging = aging;
+
+    /*
+     * The new offset is applied with the next conversion. While the chip runs its own, the
+     * forced one is started as soon as BSY clears. A forced conversion that set CONV before
+     * this write is joined; at the latest the next 64 s conversion applies the offset then.
+     */
+    return ds3231_temp_convert_locked(chip, &seq);
+}
+
+
+bool ds3231_anchor_refine(s64 *anchor, s64 *floor, bool valid, s64 shift, s64 start, s64 end)
+{
+    s64 prev = *anchor + shift, upper = end, lower = start - NSEC_PER_SEC;
+
+    if (valid && prev <= lower && prev < end) {
+        /*
+         * The RTC runs slower than the monotonic clock and its second boundary has fallen
+         * behind the extrapolated anchor. It lay before the anchor until this read, so it
+         * follows right after the new lower bound.
+         */
+        *anchor = lower + 1;
+        *floor = lower;
+        return false;
+    }
+
+    if (valid) {
+        upper = min(upper, prev);
+        lower = max(lower, *floor + shift);
+    }
+
+    /* A lower bound from earlier reads beyond this read means the RTC runs fast: start over */
+    if (upper <= lower) {
+        upper = end;
+        lower = start - NSEC_PER_SEC;
+    }
+
+    *anchor = upper;
+    *floor = lower;
+    return valid && upper == prev;
+}
+
+
+/**
+ * Returns the current time of the RTC from the cache or a new snapshot.
+ * See <tt>ds3231_get_time(ds3231_time_t*)</tt>. The caller has to hold <tt>chip->lock</tt>.
+ */
+static int ds3231_get_time_locked(ds3231_status_t *chip, ds3231_time_t *time)
+{
+    ktime_t now = ktime_get();
+    s64 elapsed, anchor, floor;
+    time64_t secs;
+    int retval;
+
+    if (cache_ms != 0 && chip->cache_valid) {
+        elapsed = ktime_to_ns(ktime_sub(now, chip->cache_anchor));
+        if (elapsed < (s64)cache_ms * NSEC_PER_MSEC) {
+            ds3231_secs_to_time(chip->cache_secs + div_s64(elapsed, NSEC_PER_SEC), time);
+            return 0;
+        }
+    }
+
+    /* While the chip is unreachable the extrapolated time is better than an error */
+    retval = ds3231_read_snapshot(chip, time);
+    if (retval < 0) {
+        return ds3231_health_stale_time(chip, time, retval);
+    }
+
+    if (cache_ms == 0) {
+        return 0;
+    }
+
+    /*
+     * The anchor approximates the instant the RTC entered cache_secs. Every read
+     * narrows it down from both sides, so over several re-syncs it converges onto
+     * the RTC's second boundary and follows it when the RTC drifts.
+     */
+    secs = ds3231_time_to_secs(time);
+    anchor = ktime_to_ns(chip->cache_anchor);
+    floor = ktime_to_ns(chip->cache_floor);
+    ds3231_anchor_refine(&anchor, &floor, chip->cache_valid, (secs - chip->cache_secs) * NSEC_PER_SEC,
+                         ktime_to_ns(now), ktime_to_ns(ktime_get()));
+
+    chip->cache_secs = secs;
+    chip->cache_anchor = ns_to_ktime(anchor);
+    chip->cache_floor = ns_to_ktime(floor);
+    chip->cache_valid = 1;
+    return 0;
+}
+
+
+int ds3231_read_alarm(ds3231_status_t *chip, u8 n, ds3231_alarm_t *alarm)
+{
+    u8 regs[DS3231_REG_STATUS - DS3231_REG_A1SECONDS + 1];
+    const u8 *a;
+    int retval;
+
+    if (n != 1 && n != 2) {
+        return -EINVAL;
+    }
+
+    /* Alarm registers, control and status in one burst */
+    RETURN_IF_LTZ(ds3231_read_regs(chip, DS3231_REG_A1SECONDS, sizeof(regs), regs), retval);
+
+    if (n == 1) {
+        a = &regs[DS3231_REG_A1SECONDS - DS3231_REG_A1SECONDS];
+        alarm->second = ds3231_bcd2bin(a[0] & 0x7f);
+        a++;
+    } else {
+        a = &regs[DS3231_REG_A2MINUTES - DS3231_REG_A1SECONDS];
+        alarm->second = 0;
+    }
+
+    alarm->minute = ds3231_bcd2bin(a[0] & 0x7f);
+    alarm->hour = ds3231_bcd2bin(a[1] & 0x3f);
+    alarm->day = ds3231_bcd2bin(a[2] & 0x3f);
+    alarm->enabled = !!(regs[DS3231_REG_CONTROL - DS3231_REG_A1SECONDS] & (n == 1 ? DS3231_MASK_A1IE : DS3231_MASK_A2IE));
+    alarm->pending = !!(regs[DS3231_REG_STATUS - DS3231_REG_A1SECONDS] & (n == 1 ? DS3231_MASK_A1F : DS3231_MASK_A2F));
+    return 0;
+}
+
+
+int ds3231_write_alarm(ds3231_status_t *chip, u8 n, const ds3231_alarm_t *alarm)
+{
+    u8 regs[4], ctrl[2];
+    u8 ie = n == 1 ? DS3231_MASK_A1IE : DS3231_MASK_A2IE;
+    u8 flag = n == 1 ? DS3231_MASK_A1F : DS3231_MASK_A2F;
+    u8 len = 0;
+    int retval;
+
+    if (n != 1 && n != 2) {
+        return -EINVAL;
+    }
+
+    /* Match on date, hours, minutes and seconds: all A?M? bits and DY/DT cleared */
+    if (n == 1) {
+        regs[len++] = ds3231_bin2bcd(alarm->second);
+    }
+    regs[len++] = ds3231_bin2bcd(alarm->minute);
+    regs[len++] = ds3231_bin2bcd(alarm->hour);
+    regs[len++] = ds3231_bin2bcd(alarm->day);
+
+    RETURN_IF_LTZ(ds3231_read_regs(chip, DS3231_REG_CONTROL, sizeof(ctrl), ctrl), retval);
+
+    /* Disable the alarm while it is reprogrammed so it cannot fire on a half-written match */
+    if (ctrl[0] & ie) {
+        ctrl[0] &= ~ie;
+        RETURN_IF_LTZ(ds3231_write_regs(chip, DS3231_REG_CONTROL, 1, &ctrl[0]), retval);
+    }
+
+    RETURN_IF_LTZ(ds3231_write_regs(chip, n == 1 ? DS3231_REG_A1SECONDS : DS3231_REG_A2MINUTES, len, regs), retval);
+    ctrl[1] &= ~flag;
+    RETURN_IF_LTZ(ds3231_write_regs(chip, DS3231_REG_STATUS, 1, &ctrl[1]), retval);
+
+    if (alarm->enabled) {
+        ctrl[0] |= ie;
+        RETURN_IF_LTZ(ds3231_write_regs(chip, DS3231_REG_CONTROL, 1, &ctrl[0]), retval);
+    }
+
+    /* A?IE and A?F share their bit positions, so this mask works for both registers */
+    WRITE_ONCE(chip->alarm_enabled, alarm->enabled ? (chip->alarm_enabled | ie) : (chip->alarm_enabled & ~ie));
+    return 0;
+}
+
+
+int ds3231_ack_alarms(ds3231_status_t *chip, u8 *fired)
+{
+    u8 status;
+    int retval;
+
+    RETURN_IF_LTZ(ds3231_read_regs(chip, DS3231_REG_STATUS, 1, &status), retval);
+
+    /* Flags of disabled alarms are set as well, but nobody is waiting for them */
+    *fired = status & chip->alarm_enabled & (DS3231_MASK_A1F | DS3231_MASK_A2F);
+    if (*fired == 0) {
+        return 0;
+    }
+
+    /* Flags can only be written to 0, writing 1 leaves them unchanged */
+    status &= ~*fired;
+    RETURN_IF_LTZ(ds3231_write_regs(chip, DS3231_REG_STATUS, 1, &status), retval);
+    return 0;
+}
+
+
+/**
+ * Returns the current time of the RTC, sharing the bus access of concurrent readers.
+ * See <tt>ds3231_get_time(ds3231_time_t*)</tt>.
+ */
+static int ds3231_get_time_shared(ds3231_status_t *chip, ds3231_time_t *time)
+{
+    u32 seq;
+    int retval;
+
+retry:
+    spin_lock(&chip->read_lock);
+    if (chip->read_in_flight) {
+        /* Another reader is already talking to the RTC: sleep until it is done and share its result */
+        seq = chip->read_seq;
+        spin_unlock(&chip->read_lock);
+
+        RETURN_IF_LTZ(wait_event_interruptible(chip->read_wait, READ_ONCE(chip->read_seq) != seq), retval);
+
+        spin_lock(&chip->read_lock);
+        *time = chip->read_time;
+        retval = chip->read_result;
+        spin_unlock(&chip->read_lock);
+
+        /* The reader we waited for was interrupted before touching the bus, so try again ourselves */
+        if (retval == -EINTR) {
+            goto retry;
+        }
+        return retval;
+    }
+    chip->read_in_flight = 1;
+    spin_unlock(&chip->read_lock);
+
+    /* Queue up behind writers and other bus users */
+    retval = mutex_lock_interruptible(&chip->lock);
+    if (retval == 0) {
+        retval = ds3231_get_time_locked(chip, time);
+        mutex_unlock(&chip->lock);
+    }
+
+    /* Publish the result to all readers that piggybacked on this read */
+    spin_lock(&chip->read_lock);
+    if (retval == 0) {
+        chip->read_time = *time;
+    }
+    chip->read_result = retval;
+    chip->read_seq++;
+    chip->read_in_flight = 0;
+    spin_unlock(&chip->read_lock);
+    wake_up_interruptible_all(&chip->read_wait);
+
+    return retval;
+}
+
+
+int ds3231_get_time(ds3231_status_t *chip, ds3231_time_t *time)
+{
+    ktime_t start = ds3231_op_begin(chip, DS3231_OP_GET_TIME);
+
+    return ds3231_op_end(chip, DS3231_OP_GET_TIME, start, ds3231_get_time_shared(chip, time));
 }
\ No newline at end of file
@@ -1,8 +1,19 @@
-/****************************************************
- * ( ) ds3231_hw.c  :: Hardware interfacing         *
- * (*) ds3231_io.c  :: Character device interfacing *
- * ( ) ds3231_mod.c :: Linux module handling        *
- ****************************************************/
+/*******************************************************
+ * ( ) ds3231_hw.c     :: Hardware interfacing         *
+ * ( ) ds3231_health.c :: Bus error recovery           *
+ * ( ) ds3231_codec.c  :: Register conversion          *
+ * ( ) ds3231_emul.c   :: Emulated register model      *
+ * ( ) ds3231_sync.c   :: Second-aligned time setting  *
+ * ( ) ds3231_page.c   :: Shared time page             *
+ * ( ) ds3231_irq.c    :: Interrupt handling           *
+ * ( ) ds3231_timer.c  :: Alarm timer multiplexing     *
+ * ( ) ds3231_temp.c   :: Temperature sampling         *
+ * ( ) ds3231_calib.c  :: Aging offset calibration     *
+ * ( ) ds3231_debug.c  :: Tracing and statistics       *
+ * (*) ds3231_io.c     :: Character device interfacing *
+ * ( ) ds3231_rtc.c    :: RTC class interfacing        *
+ * ( ) ds3231_mod.c    :: Linux module handling        *
+ *******************************************************/
 #include "ds3231.h"
 
 /**
@@ -11,16 +22,29 @@
  * @{ 
  */
 dev_t ds3231_dev;
-struct cdev ds3231_cdev;
 struct class *ds3231_device_class;
 /** @} */
 
+/** Number of sub-second digits appended to the seconds of the text read path */
+static unsigned int subsec_digits;
+module_param(subsec_digits, uint, 0644);
+MODULE_PARM_DESC(subsec_digits, "Append this many digits (up to 9) of the time since the last second boundary to the seconds read from the device (0 = whole seconds)");
+
+/** Chips by minor number of their character device (<tt>null</tt> for free minors) */
+static ds3231_status_t *ds3231_chips[DS3231_MAX_CHIPS];
+/** Protects <tt>ds3231_chips</tt> and the references taken on open */
+static DEFINE_MUTEX(ds3231_chips_lock);
+
 /** Character device operations configuration */
 struct file_operations ds3231_fops = {
     .owner = THIS_MODULE,
     .llseek = no_llseek,
-    .read = ds3231_io_read,
-    .write = ds3231_io_write,
+    .read_iter = ds3231_io_read_iter,
+    .write_iter = ds3231_io_write_iter,
+    .poll = ds3231_io_poll,
+    .mmap = ds3231_io_mmap,
+    .unlocked_ioctl = ds3231_io_ioctl,
+    .compat_ioctl = ds3231_io_ioctl,
     .open = ds3231_io_open,
     .release = ds3231_io_close,
 };
@@ -32,74 +56,195 @@ int ds3231_io_init(void)
 
     pr_info("ds3231: creating character device driver ...\n");
 
-    /* Allocate a range of character device numbers */
-    ret = alloc_chrdev_region(&ds3231_dev, 0, 1, "ds3231_drv");
+    /* Allocate a range of character device numbers, one for every chip */
+    ret = alloc_chrdev_region(&ds3231_dev, 0, DS3231_MAX_CHIPS, "ds3231_drv");
     if (ret < 0)
     {
         pr_err("ds3231: alloc_chrdev_region() failed\n");
         return ret;
     }
 
-    /* Initialize the cdev structure and add the driver to the system */
-    cdev_init(&ds3231_cdev, &ds3231_fops);
-    ret = cdev_add(&ds3231_cdev, ds3231_dev, 1);
-    if (ret < 0)
-    {
-        pr_err("ds3231: character device could not be registered");
-        goto unreg_chrdev;
-    }
-
     /* Create a character device class */
     ds3231_device_class = class_create(THIS_MODULE, "chardev");
-    if (ds3231_device_class == NULL)
+    if (IS_ERR(ds3231_device_class))
     {
         pr_err("ds3231: character device class could not be created\n");
-        goto clenup_cdev;
-    }
-
-    /* Create the character device */
-    if (device_create(ds3231_device_class, NULL, ds3231_dev, NULL, "ds3231_drv") == NULL)
-    {
-        pr_err("ds3231: character device could not be created\n");
-        goto cleanup_chrdev_class;
+        unregister_chrdev_region(ds3231_dev, DS3231_MAX_CHIPS);
+        return -EIO;
     }
 
     /* ds3231_drv initialized successfully */
     pr_info("ds3231: character device driver successfully created\n");
     return 0;
-
-    /* Uninit on failure */
-cleanup_chrdev_class:
-    class_destroy(ds3231_device_class);
-clenup_cdev:
-    cdev_del(&ds3231_cdev);
-unreg_chrdev:
-    unregister_chrdev_region(ds3231_dev, 1);
-    return -EIO;
 }
 
 void ds3231_io_exit(void)
 {
-    device_destroy(ds3231_device_class, ds3231_dev);
     class_destroy(ds3231_device_class);
-    cdev_del(&ds3231_cdev);
-    unregister_chrdev_region(ds3231_dev, 1);
+    unregister_chrdev_region(ds3231_dev, DS3231_MAX_CHIPS);
     pr_info("ds3231: unloaded chacter device driver\n");
 }
 
+int ds3231_io_add(ds3231_status_t *chip)
+{
+    struct device *device;
+    dev_t devt;
+    int minor, ret;
+
+    /* Reserve the first free minor */
+    mutex_lock(&ds3231_chips_lock);
+    for (minor = 0; minor < DS3231_MAX_CHIPS && ds3231_chips[minor] != null; minor++)
+        ;
+
+    if (minor == DS3231_MAX_CHIPS)
+    {
+        mutex_unlock(&ds3231_chips_lock);
+        pr_err("ds3231: no free minor number for %s\n", dev_name(&chip->client->dev));
+        return -ENOSPC;
+    }
+
+    ds3231_chips[minor] = ERR_PTR(-EBUSY);
+    mutex_unlock(&ds3231_chips_lock);
+
+    chip->minor = minor;
+    devt = MKDEV(MAJOR(ds3231_dev), minor);
+
+    /* The cdev is allocated separately, since it may outlive the chip state while a file is being closed */
+    chip->cdev = cdev_alloc();
+    if (chip->cdev == null)
+    {
+        ret = -ENOMEM;
+        goto release_minor;
+    }
+
+    chip->cdev->owner = THIS_MODULE;
+    chip->cdev->ops = &ds3231_fops;
+    ret = cdev_add(chip->cdev, devt, 1);
+    if (ret < 0)
+    {
+        pr_err("ds3231: character device could not be registered\n");
+        kobject_put(&chip->cdev->kobj);
+        goto release_minor;
+    }
+
+    /* Create the character device (the first chip keeps the name of the single chip driver) */
+    device = minor == 0 ? device_create(ds3231_device_class, &chip->client->dev, devt, null, "ds3231_drv")
+                        : device_create(ds3231_device_class, &chip->client->dev, devt, null, "ds3231_drv%d", minor);
+    if (IS_ERR(device))
+    {
+        pr_err("ds3231: character device could not be created\n");
+        ret = PTR_ERR(device);
+        cdev_del(chip->cdev);
+        goto release_minor;
+    }
+
+    /* Publish the chip to open() */
+    mutex_lock(&ds3231_chips_lock);
+    ds3231_chips[minor] = chip;
+    mutex_unlock(&ds3231_chips_lock);
+
+    pr_info("ds3231: %s is %s\n", dev_name(&chip->client->dev), dev_name(device));
+    return 0;
+
+release_minor:
+    mutex_lock(&ds3231_chips_lock);
+    ds3231_chips[minor] = null;
+    mutex_unlock(&ds3231_chips_lock);
+    return ret;
+}
+
+void ds3231_io_remove(ds3231_status_t *chip)
+{
+    /* No new file handles after this; open ones keep their reference */
+    mutex_lock(&ds3231_chips_lock);
+    ds3231_chips[chip->minor] = ERR_PTR(-ENODEV);
+    mutex_unlock(&ds3231_chips_lock);
+
+    device_destroy(ds3231_device_class, MKDEV(MAJOR(ds3231_dev), chip->minor));
+    cdev_del(chip->cdev);
+
+    mutex_lock(&ds3231_chips_lock);
+    ds3231_chips[chip->minor] = null;
+    mutex_unlock(&ds3231_chips_lock);
+}
+
+void ds3231_io_for_each_chip(void (*fn)(ds3231_status_t *chip))
+{
+    int minor;
+
+    mutex_lock(&ds3231_chips_lock);
+    for (minor = 0; minor < DS3231_MAX_CHIPS; minor++)
+    {
+        if (!IS_ERR_OR_NULL(ds3231_chips[minor]))
+        {
+            fn(ds3231_chips[minor]);
+        }
+    }
+    mutex_unlock(&ds3231_chips_lock);
+}
+
+static void ds3231_io_read_work(struct work_struct *work);
+static void ds3231_io_write_work(struct work_struct *work);
+
 int ds3231_io_open(struct inode *inode, struct file *file)
 {
+    ds3231_status_t *chip;
+    ds3231_file_t *priv;
+
+    priv = kzalloc(sizeof(*priv), GFP_KERNEL);
+    if (priv == null)
+    {
+        return -ENOMEM;
+    }
+
+    /* Look up the chip and keep it alive while the file is open */
+    mutex_lock(&ds3231_chips_lock);
+    chip = iminor(inode) < DS3231_MAX_CHIPS ? ds3231_chips[iminor(inode)] : null;
+    if (IS_ERR_OR_NULL(chip))
+    {
+        mutex_unlock(&ds3231_chips_lock);
+        kfree(priv);
+        return -ENODEV;
+    }
+    kref_get(&chip->ref);
+    mutex_unlock(&ds3231_chips_lock);
+
+    priv->chip = chip;
+    mutex_init(&priv->lock);
+    INIT_LIST_HEAD(&priv->timers);
+    INIT_LIST_HEAD(&priv->expired);
+    INIT_WORK(&priv->read_work, ds3231_io_read_work);
+    INIT_WORK(&priv->write_work, ds3231_io_write_work);
+    init_waitqueue_head(&priv->async_wait);
+    spin_lock_init(&priv->async_lock);
+    file->private_data = priv;
+
     pr_debug("ds3231: opened character device\n");
     return 0;
 }
 
 int ds3231_io_close(struct inode *inode, struct file *file)
 {
+    ds3231_file_t *priv = file->private_data;
+
+    /* A submitted write is still applied, a render nobody reads any more is dropped */
+    flush_work(&priv->write_work);
+    cancel_work_sync(&priv->read_work);
+    ds3231_timer_release(priv);
+    ds3231_chip_put(priv->chip);
+    kfree(priv);
     pr_debug("ds3231: closed character device\n");
     return 0;
 }
 
-ssize_t ds3231_io_read(struct file *file, char __user *buffer, size_t bytes, loff_t *offset)
+/**
+ * Reads time and status from the RTC and renders them into the per-open buffer of <tt>priv</tt>
+ * in the format <tt>DD. M hh:mm:ss YYYY</tt>, followed by a newline. With <tt>subsec_digits</tt> set,
+ * the seconds carry that many digits of fraction (<tt>hh:mm:ss.fff</tt>), see <tt>ds3231_get_timestamp</tt>.
+ *
+ * @return <tt>0</tt> on success and the return value of <tt>ds3231_get_time(ds3231_time_t*)</tt> on failure.
+ */
+static int ds3231_io_render(ds3231_file_t *priv)
 {
     /** All month names in German (may be changed) */
     static const char *MONTH_NAMES[] = {
@@ -117,128 +262,913 @@ ssize_t ds3231_io_read(struct file *file, char __user *buffer, size_t bytes, lof
         "Dezember"
     };
 
+    ds3231_status_t *chip = priv->chip;
+    unsigned int digits = min(READ_ONCE(subsec_digits), 9u);
+    struct ds3231_ioc_timestamp ts;
     ds3231_time_t time;
-    char out[28];
-    int bytes_to_copy = (bytes > sizeof(out) ? sizeof(out) : bytes);
-    int retval, bytes_not_copied;
+    unsigned int i;
+    u32 frac;
+    int retval;
+
+    /* Remember which second this rendering belongs to */
+    priv->tick = READ_ONCE(chip->tick);
 
+    /* Read time and status of the RTC in one transaction (or from the cache). Concurrent readers share one bus access. */
+    retval = ds3231_get_timestamp(chip, &ts);
+    if (retval < 0)
+    {
+        return retval;
+    }
 
-    /* Make sure the I2C bus is not in use. */
-    if (atomic_cmpxchg(&ds3231_status.drv_busy, UNLOCKED, LOCKED) == LOCKED)
+    /* Bring the time into the correct format */
+    ds3231_secs_to_time(ts.seconds, &time);
+    if (digits == 0)
     {
-        pr_err("ds3231: device busy\n");
-        return -EBUSY;
+        priv->len = scnprintf(priv->buf, sizeof(priv->buf), "%02d. %s %02d:%02d:%02d %04d\n", time.day, MONTH_NAMES[time.month - 1], time.hour, time.minute, time.second, time.year);
+        return 0;
     }
 
-    /* Read the status register of the RTC */
-    retval = ds3231_read_status();
+    for (frac = ts.nsec, i = digits; i < 9; i++)
+    {
+        frac /= 10;
+    }
+
+    priv->len = scnprintf(priv->buf, sizeof(priv->buf), "%02d. %s %02d:%02d:%02d.%0*u %04d\n", time.day, MONTH_NAMES[time.month - 1], time.hour, time.minute, time.second,
+                          (int)digits, frac, time.year);
+    return 0;
+}
+
+/** Copies the rendered text from <tt>*offset</tt> on to <tt>to</tt>. The caller has to hold <tt>priv->lock</tt>. */
+static ssize_t ds3231_io_copy(ds3231_file_t *priv, loff_t *offset, struct iov_iter *to)
+{
+    size_t copied;
+
+    if (*offset >= priv->len)
+    {
+        return 0;
+    }
+
+    copied = copy_to_iter(priv->buf + *offset, priv->len - *offset, to);
+    if (copied == 0 && iov_iter_count(to) != 0)
+    {
+        return -EFAULT;
+    }
+
+    *offset += copied;
+    return copied;
+}
+
+/** Renders the time for a non-blocking read in process context without holding up the reader */
+static void ds3231_io_read_work(struct work_struct *work)
+{
+    ds3231_file_t *priv = container_of(work, ds3231_file_t, read_work);
+    int retval;
+
+    mutex_lock(&priv->lock);
+    retval = ds3231_io_render(priv);
     if (retval < 0)
     {
-        atomic_set(&ds3231_status.drv_busy, UNLOCKED);
+        priv->read_error = retval;
+    }
+    else
+    {
+        priv->read_fresh = 1;
+    }
+    WRITE_ONCE(priv->read_pending, 0);
+    mutex_unlock(&priv->lock);
+
+    wake_up_interruptible_all(&priv->async_wait);
+}
+
+/**
+ * Hands the render of a non-blocking read to the read work, or returns the error of the last
+ * one. The caller has to hold <tt>priv->lock</tt>.
+ *
+ * @return <tt>-EAGAIN</tt> while the render is in flight and the error of a failed render otherwise.
+ */
+static int ds3231_io_submit_read(ds3231_file_t *priv)
+{
+    int retval = priv->read_error;
+
+    if (priv->read_pending)
+    {
+        return -EAGAIN;
+    }
+
+    if (retval < 0)
+    {
+        priv->read_error = 0;
         return retval;
     }
 
-    /* Read the time from the RTC */
-    ds3231_read_time(&time);
-    atomic_set(&ds3231_status.drv_busy, UNLOCKED);
+    WRITE_ONCE(priv->read_pending, 1);
+    schedule_work(&priv->read_work);
+    return -EAGAIN;
+}
 
-    /* Bring the time into the correct format */
-    memset(out, '\0', sizeof(out));
-    snprintf(out, sizeof(out) - 1, "%02d. %s %02d:%02d:%02d %04d", time.day, MONTH_NAMES[time.month - 1], time.hour, time.minute, time.second, time.year);
-    bytes_not_copied = copy_to_user(buffer, out, bytes_to_copy);
-    return bytes_not_copied != 0 ? -EIO : bytes;
+ssize_t ds3231_io_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    struct file *file = iocb->ki_filp;
+    ds3231_file_t *priv = file->private_data;
+    ds3231_status_t *chip = priv->chip;
+    bool nonblock = file->f_flags & O_NONBLOCK;
+    loff_t *offset = &iocb->ki_pos;
+    ssize_t retval = 0;
+
+    /* Non-blocking readers never wait, not even for the read work holding the lock */
+    if (nonblock)
+    {
+        if (!mutex_trylock(&priv->lock))
+        {
+            return -EAGAIN;
+        }
+    }
+    else
+    {
+        retval = mutex_lock_interruptible(&priv->lock);
+        if (retval < 0)
+        {
+            return retval;
+        }
+    }
+
+    /* A text rendered by the read work is read from the start */
+    if (priv->read_fresh)
+    {
+        priv->read_fresh = 0;
+        *offset = 0;
+    }
+
+    /* Once everything was read, a new RTC second makes the file readable from the start again */
+    if (priv->len != 0 && *offset >= priv->len && chip->ticking && READ_ONCE(chip->tick) != priv->tick)
+    {
+        priv->len = 0;
+        *offset = 0;
+    }
+
+    /* Only the first read of an open file handle (or of a new second) accesses the RTC */
+    if (priv->len == 0)
+    {
+        retval = nonblock ? ds3231_io_submit_read(priv) : ds3231_io_render(priv);
+    }
+
+    if (retval == 0)
+    {
+        retval = ds3231_io_copy(priv, offset, to);
+    }
+
+    mutex_unlock(&priv->lock);
+    return retval;
 }
 
-ssize_t ds3231_io_write(struct file *file, const char __user *buffer, size_t bytes, loff_t *offset)
+/** Returns true once the forced conversion requested through <tt>priv</tt> finished */
+static bool ds3231_io_conv_done(ds3231_file_t *priv)
 {
-    /** The number of days in each month (february has to be handled differently in leap years.) */
-    static const int MONTH_DAYS[] = { 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+    return priv->conv_seq != 0 && (s32)(READ_ONCE(priv->chip->conv_done) - priv->conv_seq) >= 0;
+}
 
-    ds3231_time_t time;
-    s32 year, month, day, hour, minute, second, temp;
-    int retval = 0;
-    char in[bytes];
+/**
+ * Readiness of a non-blocking file handle: readable once a render finished (or the text is not
+ * fully read yet), writable while no write is in flight. Event loops poll before they read,
+ * so a render that is due is submitted from here as well.
+ */
+static unsigned int ds3231_io_poll_async(ds3231_file_t *priv, struct file *file)
+{
+    ds3231_status_t *chip = priv->chip;
+    unsigned int mask = 0;
+    bool stale;
 
-    /* Make sure the I2C bus is not in use.  */
-    if (atomic_cmpxchg(&ds3231_status.drv_busy, UNLOCKED, LOCKED) == LOCKED)
+    spin_lock(&priv->async_lock);
+    if (!priv->write_pending)
     {
-        pr_err("ds3231: device busy\n");
-        return -EBUSY;
+        mask |= POLLOUT | POLLWRNORM;
     }
 
-    /* Get data from the user (while checking that all bytes could be read) */
-    if (copy_from_user(in, buffer, bytes) != 0) {
-        pr_err("ds3231: could not read bytes from userland\n");
-        atomic_set(&ds3231_status.drv_busy, UNLOCKED);
-        return -EINVAL;
+    if (priv->write_error < 0)
+    {
+        mask |= POLLERR;
+    }
+    spin_unlock(&priv->async_lock);
+
+    /* The read work holds the lock while it talks to the chip and wakes us when it is done */
+    if (!mutex_trylock(&priv->lock))
+    {
+        return mask;
     }
 
-    if (in[0] == '$')
+    stale = priv->len == 0 || (chip->ticking && file->f_pos >= priv->len && READ_ONCE(chip->tick) != priv->tick);
+    if (priv->read_fresh || priv->read_error < 0)
     {
-        if (sscanf(in + 1, "%d", &temp) < 0)
+        mask |= POLLIN | POLLRDNORM;
+    }
+    else if (stale)
+    {
+        if (!priv->read_pending)
         {
-            atomic_set(&ds3231_status.drv_busy, UNLOCKED);
+            WRITE_ONCE(priv->read_pending, 1);
+            schedule_work(&priv->read_work);
+        }
+    }
+    else if (file->f_pos < priv->len || !chip->ticking)
+    {
+        mask |= POLLIN | POLLRDNORM;
+    }
+
+    mutex_unlock(&priv->lock);
+    return mask;
+}
+
+unsigned int ds3231_io_poll(struct file *file, poll_table *wait)
+{
+    ds3231_file_t *priv = file->private_data;
+    ds3231_status_t *chip = priv->chip;
+    unsigned int mask = 0;
+
+    poll_wait(file, &chip->alarm_wait, wait);
+    poll_wait(file, &chip->conv_wait, wait);
+    if (!list_empty_careful(&priv->expired) || ds3231_io_conv_done(priv))
+    {
+        mask |= POLLPRI;
+    }
+
+    if (file->f_flags & O_NONBLOCK)
+    {
+        poll_wait(file, &priv->async_wait, wait);
+        if (chip->ticking)
+        {
+            poll_wait(file, &chip->tick_wait, wait);
+        }
+
+        return mask | ds3231_io_poll_async(priv, file);
+    }
+
+    /* Without the square wave interrupt reads never block */
+    if (!chip->ticking)
+    {
+        return mask | POLLIN | POLLRDNORM;
+    }
+
+    poll_wait(file, &chip->tick_wait, wait);
+    if (priv->len == 0 || file->f_pos < priv->len || READ_ONCE(chip->tick) != priv->tick)
+    {
+        mask |= POLLIN | POLLRDNORM;
+    }
+
+    return mask;
+}
+
+int ds3231_io_mmap(struct file *file, struct vm_area_struct *vma)
+{
+    ds3231_file_t *priv = file->private_data;
+    ds3231_status_t *chip = priv->chip;
+    ds3231_time_t time;
+
+    /* Fill in the time before the first reader looks; a failed read leaves the page invalid */
+    if (!READ_ONCE(chip->page->valid)) {
+        ds3231_get_time(chip, &time);
+    }
+
+    return ds3231_page_mmap(chip, vma);
+}
+
+/** Layout of the text form of a time, where <tt>d</tt> stands for a decimal digit */
+static const char DS3231_TIME_LAYOUT[] = "dddd-dd-dd dd:dd:dd";
+
+/** Returns the value of the <tt>n</tt> decimal digits at <tt>in</tt>, which have been checked already */
+static unsigned int ds3231_io_digits(const char *in, unsigned int n)
+{
+    unsigned int val = 0;
+
+    while (n-- > 0) {
+        val = val * 10 + (*in++ - '0');
+    }
+
+    return val;
+}
+
+/**
+ * Parses a time of the form <tt>YYYY-MM-DD hh:mm:ss</tt> in a single pass.
+ *
+ * @return <tt>0</tt> on success, <tt>-ENOEXEC</tt> if the input does not match the layout or a
+ * field is out of range and <tt>-EOVERFLOW</tt> if the year is before 2000 or after 2199.
+ */
+static int ds3231_io_parse_time(const char *in, size_t len, ds3231_time_t *time)
+{
+    unsigned int year, month;
+    size_t i;
+
+    if (len != sizeof(DS3231_TIME_LAYOUT) - 1) {
+        return -ENOEXEC;
+    }
+
+    for (i = 0; i < len; i++) {
+        if (DS3231_TIME_LAYOUT[i] == 'd' ? (in[i] < '0' || in[i] > '9') : in[i] != DS3231_TIME_LAYOUT[i]) {
             return -ENOEXEC;
         }
+    }
 
-        ds3231_status.drv_temp_test = 1;
+    year = ds3231_io_digits(in, 4);
+    month = ds3231_io_digits(in + 5, 2);
+    time->day = ds3231_io_digits(in + 8, 2);
+    time->hour = ds3231_io_digits(in + 11, 2);
+    time->minute = ds3231_io_digits(in + 14, 2);
+    time->second = ds3231_io_digits(in + 17, 2);
+
+    /* Make sure month, day of the month, hour, minute and second are in range */
+    if (month < 1 || month > 12 || time->day < 1 || time->day > ds3231_month_days(year, month) ||
+        time->hour > 23 || time->minute > 59 || time->second > 59) {
+        return -ENOEXEC;
+    }
+
+    /* Make sure the year is in range */
+    if (year < 2000 || year > 2199) {
+        return -EOVERFLOW;
+    }
+
+    time->year = year;
+    time->month = month;
+    return 0;
+}
+
+/**
+ * Converts seconds since the epoch to a time the RTC can hold.
+ *
+ * @return <tt>0</tt> on success and <tt>-EOVERFLOW</tt> if the time is before 2000 or after 2199.
+ */
+static int ds3231_io_parse_secs(time64_t secs, ds3231_time_t *time)
+{
+    if (secs < mktime64(2000, 1, 1, 0, 0, 0) || secs > mktime64(2199, 12, 31, 23, 59, 59)) {
+        return -EOVERFLOW;
+    }
+
+    ds3231_secs_to_time(secs, time);
+    return 0;
+}
+
+/**
+ * Parses <tt>@</tt> followed by the number of seconds since the epoch.
+ *
+ * @return <tt>0</tt> on success, <tt>-ENOEXEC</tt> if the input is not a number and
+ * <tt>-EOVERFLOW</tt> if the time is before 2000 or after 2199.
+ */
+static int ds3231_io_parse_epoch(const char *in, size_t len, ds3231_time_t *time)
+{
+    time64_t secs = 0;
+    size_t i;
+
+    /* 12 digits reach far beyond 2199 without overflowing */
+    if (len < 2 || len > 13) {
+        return -ENOEXEC;
+    }
+
+    for (i = 1; i < len; i++) {
+        if (in[i] < '0' || in[i] > '9') {
+            return -ENOEXEC;
+        }
+        secs = secs * 10 + (in[i] - '0');
+    }
+
+    return ds3231_io_parse_secs(secs, time);
+}
+
+/**
+ * Parses a <tt>struct ds3231_time_record</tt>.
+ *
+ * @return <tt>0</tt> on success, <tt>-ENOEXEC</tt> if the reserved bytes are set and
+ * <tt>-EOVERFLOW</tt> if the time is before 2000 or after 2199.
+ */
+static int ds3231_io_parse_record(const char *in, ds3231_time_t *time)
+{
+    struct ds3231_time_record record;
+
+    memcpy(&record, in, sizeof(record));
+    if (memchr_inv(record.reserved, 0, sizeof(record.reserved)) != null) {
+        return -ENOEXEC;
+    }
+
+    return ds3231_io_parse_secs(record.seconds, time);
+}
+
+/** Commands of a write that still have to be applied to the chip (see <tt>ds3231_io_apply</tt>) */
+#define DS3231_IO_CMD_NONE 0
+#define DS3231_IO_CMD_SET_TIME 1
+#define DS3231_IO_CMD_SYNC 2
+
+/**
+ * Parses the <tt>bytes</tt> bytes written to the device in <tt>in</tt>, which has room for a
+ * terminating null byte. A temperature override is applied right away, it does not touch the bus.
+ *
+ * @return One of the <tt>DS3231_IO_CMD_*</tt> commands and a kernel error code on failure.
+ */
+static int ds3231_io_parse(ds3231_status_t *chip, char *in, size_t bytes, ds3231_time_t *time)
+{
+    size_t len = bytes;
+    int retval;
+    s32 temp;
+
+    if (bytes == sizeof(struct ds3231_time_record) && (u8)in[0] == DS3231_TIME_RECORD_MAGIC) {
+        RETURN_IF_LTZ(ds3231_io_parse_record(in, time), retval);
+        return DS3231_IO_CMD_SET_TIME;
+    }
+
+    /* Text forms may end with a newline */
+    if (in[len - 1] == '\n') {
+        len--;
+    }
+    in[len] = '\0';
+
+    if (len > 0 && in[0] == '$')
+    {
+        if (kstrtos32(in + 1, 10, &temp) < 0)
+        {
+            return -ENOEXEC;
+        }
+
+        mutex_lock(&chip->lock);
+        chip->drv_temp_test = 1;
 
         pr_info("ds3231: manual temperature override: %d°C\n", temp);
-        ds3231_status.temp = (s8)temp;
-        atomic_set(&ds3231_status.drv_busy, UNLOCKED);
-        return bytes;
+        chip->temp = (s16)(temp * 4);
+        mutex_unlock(&chip->lock);
+        return DS3231_IO_CMD_NONE;
+    }
+
+    /* Set the RTC to the system time at the next second boundary */
+    if (strcmp(in, "sync") == 0) {
+        return DS3231_IO_CMD_SYNC;
+    }
+
+    if (len > 0 && in[0] == '@') {
+        RETURN_IF_LTZ(ds3231_io_parse_epoch(in, len, time), retval);
+    } else {
+        RETURN_IF_LTZ(ds3231_io_parse_time(in, len, time), retval);
+    }
+
+    return DS3231_IO_CMD_SET_TIME;
+}
+
+/**
+ * Applies a parsed write to the chip. Sleeps until all earlier users of the I2C bus are done.
+ *
+ * @return <tt>0</tt> on success and a kernel error code on failure.
+ */
+static int ds3231_io_apply(ds3231_status_t *chip, int cmd, ds3231_time_t *time)
+{
+    struct ds3231_ioc_sync sync;
+    int retval;
+
+    if (cmd == DS3231_IO_CMD_SYNC) {
+        RETURN_IF_LTZ(ds3231_sync_time(chip, &sync), retval);
+        pr_info("ds3231: synchronized to the system time, error %lld ns (%s)\n", sync.error_ns,
+                sync.measured ? "measured" : "estimated");
+        return 0;
+    }
+
+    /* Wait for other users of the I2C bus to finish */
+    retval = mutex_lock_interruptible(&chip->lock);
+    if (retval < 0)
+    {
+        return retval;
     }
 
     /* Read the status register of the RTC */
-    retval = ds3231_read_status();
+    retval = ds3231_read_status(chip);
+    if (retval < 0)
+    {
+        mutex_unlock(&chip->lock);
+        return retval;
+    }
+
+    pr_info("ds3231: write time %d. %d. %d %d:%d:%d\n", time->day, time->month, time->year, time->hour, time->minute, time->second);
+
+    /* Write the time to the RTC */
+    retval = ds3231_write_time(chip, time);
+    mutex_unlock(&chip->lock);
+    return retval;
+}
+
+/** Applies the write submitted by a non-blocking writer */
+static void ds3231_io_write_work(struct work_struct *work)
+{
+    ds3231_file_t *priv = container_of(work, ds3231_file_t, write_work);
+    int retval;
+
+    retval = ds3231_io_apply(priv->chip, priv->write_cmd, &priv->write_time);
+
+    spin_lock(&priv->async_lock);
+    priv->write_error = retval < 0 ? retval : 0;
+    priv->write_pending = 0;
+    spin_unlock(&priv->async_lock);
+
+    wake_up_interruptible_all(&priv->async_wait);
+}
+
+/**
+ * Takes the error of the last write applied by the write work, which is reported only once.
+ * The caller has to hold <tt>priv->async_lock</tt>.
+ *
+ * @return <tt>-EAGAIN</tt> while a write is in flight, the error of the last write or <tt>0</tt>.
+ */
+static int ds3231_io_write_error(ds3231_file_t *priv)
+{
+    int retval = priv->write_error;
+
+    if (priv->write_pending)
+    {
+        return -EAGAIN;
+    }
+
+    priv->write_error = 0;
+    return retval;
+}
+
+/**
+ * Handles a non-blocking write of <tt>bytes</tt> bytes in <tt>in</tt>. The input is parsed right
+ * away and the write is accepted; applying it to the chip is left to the write work. If that
+ * fails, the error is returned by the next write instead of accepting it.
+ *
+ * @return The number of bytes written, <tt>-EAGAIN</tt> while an earlier write is in flight and a
+ * kernel error code if the input is invalid or the earlier write failed.
+ */
+static ssize_t ds3231_io_write_async(ds3231_file_t *priv, char *in, size_t bytes)
+{
+    ds3231_time_t time;
+    int cmd, retval;
+
+    spin_lock(&priv->async_lock);
+    retval = ds3231_io_write_error(priv);
+    spin_unlock(&priv->async_lock);
     if (retval < 0)
     {
-        atomic_set(&ds3231_status.drv_busy, UNLOCKED);
         return retval;
     }
 
-    /* Parse a date */
-    if (sscanf(in, "%d-%d-%d %d:%d:%d",
-               &year,
-               &month,
-               &day,
-               &hour,
-               &minute,
-               &second) < 0)
+    RETURN_IF_LTZ(cmd = ds3231_io_parse(priv->chip, in, bytes, &time), retval);
+    if (cmd == DS3231_IO_CMD_NONE)
+    {
+        return bytes;
+    }
+
+    /* Another writer on the same handle may have submitted since the check above */
+    spin_lock(&priv->async_lock);
+    if (priv->write_pending)
     {
-        atomic_set(&ds3231_status.drv_busy, UNLOCKED);
+        spin_unlock(&priv->async_lock);
+        return -EAGAIN;
+    }
+
+    priv->write_cmd = cmd;
+    priv->write_time = time;
+    priv->write_pending = 1;
+    spin_unlock(&priv->async_lock);
+
+    schedule_work(&priv->write_work);
+    return bytes;
+}
+
+ssize_t ds3231_io_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+    ds3231_file_t *priv = iocb->ki_filp->private_data;
+    size_t bytes = iov_iter_count(from);
+    char in[DS3231_WRITE_MAX + 1];
+    ds3231_time_t time;
+    int cmd, retval;
+
+    if (bytes == 0 || bytes > DS3231_WRITE_MAX) {
         return -EINVAL;
     }
 
-    /* Make sure month, day of the month, hour, minute and second are in range */
-    if ((12 < month || 1 > month) ||
-        (MONTH_DAYS[month - 1] + (month == 2 ? (year % 4 == 0) : 0) < day) ||
-        (23 < hour || 0 > hour) ||
-        (59 < minute || 0 > minute) ||
-        (59 < second || 0 > second))
+    /* Get data from the user (while checking that all bytes could be read) */
+    if (copy_from_iter(in, bytes, from) != bytes) {
+        pr_err("ds3231: could not read bytes from userland\n");
+        return -EFAULT;
+    }
+
+    if (iocb->ki_filp->f_flags & O_NONBLOCK) {
+        return ds3231_io_write_async(priv, in, bytes);
+    }
+
+    RETURN_IF_LTZ(cmd = ds3231_io_parse(priv->chip, in, bytes, &time), retval);
+    if (cmd != DS3231_IO_CMD_NONE) {
+        RETURN_IF_LTZ(ds3231_io_apply(priv->chip, cmd, &time), retval);
+    }
+
+    return bytes;
+}
+
+/**
+ * Returns the mask of alarms in <tt>mask</tt> (bit 0 = alarm 1, bit 1 = alarm 2) whose
+ * event counters changed compared to <tt>events</tt>.
+ */
+static u32 ds3231_io_alarms_fired(ds3231_status_t *chip, u32 mask, const u32 *events)
+{
+    u32 fired = 0;
+
+    if ((mask & 1) && READ_ONCE(chip->alarm_events[0]) != events[0])
     {
-        atomic_set(&ds3231_status.drv_busy, UNLOCKED);
-        return -ENOEXEC;
+        fired |= 1;
     }
 
-    /* Make sure the year is in range */
-    if (2199 < year || 2000 > year)
+    if ((mask & 2) && READ_ONCE(chip->alarm_events[1]) != events[1])
     {
-        atomic_set(&ds3231_status.drv_busy, UNLOCKED);
-        return -EOVERFLOW;
+        fired |= 2;
     }
 
-    time.year = year;
-    time.month = month;
-    time.day = day;
-    time.hour = hour;
-    time.minute = minute;
-    time.second = second;
+    return fired;
+}
 
-    pr_info("ds3231: write time %d. %d. %d %d:%d:%d\n", time.day, time.month, time.year, time.hour, time.minute, time.second);
+long ds3231_io_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+    void __user *argp = (void __user *)arg;
+    struct ds3231_ioc_status status;
+    struct ds3231_ioc_alarm ioc_alarm;
+    struct ds3231_ioc_timer ioc_timer;
+    struct ds3231_ioc_temp_history history;
+    struct ds3231_ioc_calib calib;
+    struct ds3231_ioc_sync sync;
+    struct ds3231_ioc_timestamp ts;
+    ds3231_temp_sample_t *samples;
+    ds3231_file_t *priv = file->private_data;
+    ds3231_status_t *chip = priv->chip;
+    ds3231_alarm_t alarm;
+    struct rtc_time tm;
+    ds3231_time_t time;
+    u32 mask, events[2];
+    u64 cookie;
+    s32 result;
+    s16 temp;
+    long retval;
 
-    /* Write the time to the RTC */
-    retval = ds3231_write_time(&time);
-    atomic_set(&ds3231_status.drv_busy, UNLOCKED);
-    return retval < 0 ? retval : bytes;
+    switch (cmd)
+    {
+    case DS3231_IOC_RD_TIME:
+        retval = ds3231_get_time(chip, &time);
+        if (retval < 0)
+        {
+            return retval;
+        }
+
+        ds3231_time_to_rtc(&time, &tm);
+        return copy_to_user(argp, &tm, sizeof(tm)) ? -EFAULT : 0;
+
+    case DS3231_IOC_SET_TIME:
+        if (copy_from_user(&tm, argp, sizeof(tm)))
+        {
+            return -EFAULT;
+        }
+
+        retval = ds3231_rtc_to_time(&tm, &time);
+        if (retval < 0)
+        {
+            return retval;
+        }
+
+        retval = mutex_lock_interruptible(&chip->lock);
+        if (retval < 0)
+        {
+            return retval;
+        }
+
+        retval = ds3231_write_time(chip, &time);
+        mutex_unlock(&chip->lock);
+        return retval;
+
+    case DS3231_IOC_RD_STATUS:
+        retval = mutex_lock_interruptible(&chip->lock);
+        if (retval < 0)
+        {
+            return retval;
+        }
+
+        /* Always read a fresh snapshot so the flags are current */
+        retval = ds3231_read_snapshot(chip, &time);
+        memset(&status, 0, sizeof(status));
+        status.temp = chip->temp;
+        status.aging = chip->aging;
+        status.osf = chip->osf;
+        status.bsy = chip->rtc_busy;
+        status.health = chip->health;
+        mutex_unlock(&chip->lock);
+
+        /* A stopped oscillator is reported through status.osf; the time is meaningless then and left zeroed */
+        if (retval == 0)
+        {
+            ds3231_time_to_rtc(&time, &status.time);
+        }
+        else if (retval != -EAGAIN)
+        {
+            return retval;
+        }
+
+        return copy_to_user(argp, &status, sizeof(status)) ? -EFAULT : 0;
+
+    case DS3231_IOC_RD_ALARM:
+        if (copy_from_user(&ioc_alarm, argp, sizeof(ioc_alarm)))
+        {
+            return -EFAULT;
+        }
+
+        retval = mutex_lock_interruptible(&chip->lock);
+        if (retval < 0)
+        {
+            return retval;
+        }
+
+        retval = ds3231_read_alarm(chip, ioc_alarm.alarm, &alarm);
+        mutex_unlock(&chip->lock);
+        if (retval < 0)
+        {
+            return retval;
+        }
+
+        memset(&ioc_alarm.time, 0, sizeof(ioc_alarm.time));
+        ioc_alarm.time.tm_sec = alarm.second;
+        ioc_alarm.time.tm_min = alarm.minute;
+        ioc_alarm.time.tm_hour = alarm.hour;
+        ioc_alarm.time.tm_mday = alarm.day;
+        ioc_alarm.enabled = alarm.enabled;
+        ioc_alarm.pending = alarm.pending;
+        return copy_to_user(argp, &ioc_alarm, sizeof(ioc_alarm)) ? -EFAULT : 0;
+
+    case DS3231_IOC_SET_ALARM:
+        if (copy_from_user(&ioc_alarm, argp, sizeof(ioc_alarm)))
+        {
+            return -EFAULT;
+        }
+
+        if (ioc_alarm.time.tm_sec < 0 || ioc_alarm.time.tm_sec > 59 ||
+            ioc_alarm.time.tm_min < 0 || ioc_alarm.time.tm_min > 59 ||
+            ioc_alarm.time.tm_hour < 0 || ioc_alarm.time.tm_hour > 23 ||
+            ioc_alarm.time.tm_mday < 1 || ioc_alarm.time.tm_mday > 31)
+        {
+            return -EINVAL;
+        }
+
+        alarm.second = ioc_alarm.time.tm_sec;
+        alarm.minute = ioc_alarm.time.tm_min;
+        alarm.hour = ioc_alarm.time.tm_hour;
+        alarm.day = ioc_alarm.time.tm_mday;
+        alarm.enabled = !!ioc_alarm.enabled;
+
+        retval = mutex_lock_interruptible(&chip->lock);
+        if (retval < 0)
+        {
+            return retval;
+        }
+
+        /* Alarm 1 belongs to the timer queue while timers are pending */
+        if (ioc_alarm.alarm == 1 && chip->timers_armed)
+        {
+            mutex_unlock(&chip->lock);
+            return ds3231_reject_busy(chip);
+        }
+
+        retval = ds3231_write_alarm(chip, ioc_alarm.alarm, &alarm);
+        mutex_unlock(&chip->lock);
+        return retval;
+
+    case DS3231_IOC_WAIT_ALARM:
+        if (get_user(mask, (u32 __user *)argp))
+        {
+            return -EFAULT;
+        }
+
+        /* Without the interrupt nobody would ever wake us up */
+        mask &= 3;
+        if (mask == 0)
+        {
+            return -EINVAL;
+        }
+
+        if (chip->irq == 0)
+        {
+            return -EOPNOTSUPP;
+        }
+
+        events[0] = READ_ONCE(chip->alarm_events[0]);
+        events[1] = READ_ONCE(chip->alarm_events[1]);
+        retval = wait_event_interruptible(chip->alarm_wait, ds3231_io_alarms_fired(chip, mask, events) != 0);
+        if (retval < 0)
+        {
+            return retval;
+        }
+
+        return put_user(ds3231_io_alarms_fired(chip, mask, events), (u32 __user *)argp);
+
+    case DS3231_IOC_ADD_TIMER:
+        if (copy_from_user(&ioc_timer, argp, sizeof(ioc_timer)))
+        {
+            return -EFAULT;
+        }
+
+        return ds3231_timer_add(priv, ioc_timer.expires, ioc_timer.cookie);
+
+    case DS3231_IOC_DEL_TIMER:
+        if (get_user(cookie, (u64 __user *)argp))
+        {
+            return -EFAULT;
+        }
+
+        return ds3231_timer_del(priv, cookie);
+
+    case DS3231_IOC_RD_EXPIRED:
+        retval = ds3231_timer_pop_expired(priv, &cookie);
+        if (retval < 0)
+        {
+            return retval;
+        }
+
+        return put_user(cookie, (u64 __user *)argp);
+
+    case DS3231_IOC_RD_TEMP_HISTORY:
+        if (copy_from_user(&history, argp, sizeof(history)))
+        {
+            return -EFAULT;
+        }
+
+        samples = kmalloc_array(min_t(u32, history.count, DS3231_TEMP_HISTORY), sizeof(*samples), GFP_KERNEL);
+        if (samples == null)
+        {
+            return -ENOMEM;
+        }
+
+        history.count = ds3231_temp_history(chip, samples, min_t(u32, history.count, DS3231_TEMP_HISTORY));
+        retval = 0;
+        if (copy_to_user(u64_to_user_ptr(history.samples), samples, history.count * sizeof(*samples)) ||
+            copy_to_user(argp, &history, sizeof(history)))
+        {
+            retval = -EFAULT;
+        }
+
+        kfree(samples);
+        return retval;
+
+    case DS3231_IOC_CONVERT_TEMP:
+        return ds3231_temp_convert(chip, &priv->conv_seq);
+
+    case DS3231_IOC_RD_CONV_TEMP:
+        if (priv->conv_seq == 0)
+        {
+            return -EINVAL;
+        }
+
+        if (!ds3231_io_conv_done(priv))
+        {
+            if (file->f_flags & O_NONBLOCK)
+            {
+                return -EAGAIN;
+            }
+
+            retval = wait_event_interruptible(chip->conv_wait, ds3231_io_conv_done(priv));
+            if (retval < 0)
+            {
+                return retval;
+            }
+        }
+
+        priv->conv_seq = 0;
+        retval = ds3231_temp_conv_result(chip, &temp);
+        if (retval < 0)
+        {
+            return retval;
+        }
+
+        return put_user(temp, (s16 __user *)argp);
+
+    case DS3231_IOC_RD_CALIB:
+        ds3231_calib_read(chip, &calib);
+        return copy_to_user(argp, &calib, sizeof(calib)) ? -EFAULT : 0;
+
+    case DS3231_IOC_SYNC_TIME:
+        retval = ds3231_sync_time(chip, &sync);
+        if (retval < 0)
+        {
+            return retval;
+        }
+
+        return copy_to_user(argp, &sync, sizeof(sync)) ? -EFAULT : 0;
+
+    case DS3231_IOC_RD_TIMESTAMP:
+        retval = ds3231_get_timestamp(chip, &ts);
+        if (retval < 0)
+        {
+            return retval;
+        }
+
+        return copy_to_user(argp, &ts, sizeof(ts)) ? -EFAULT : 0;
+
+    case DS3231_IOC_RD_WRITE_RESULT:
+        spin_lock(&priv->async_lock);
+        result = ds3231_io_write_error(priv);
+        spin_unlock(&priv->async_lock);
+        if (result == -EAGAIN)
+        {
+            return result;
+        }
+
+        return copy_to_user(argp, &result, sizeof(result)) ? -EFAULT : 0;
+
+    default:
+        return -ENOTTY;
+    }
 }
\ No newline at end of file
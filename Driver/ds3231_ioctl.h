@@ -0,0 +1,184 @@
+#ifndef DS3231_IOCTL_H
+#define DS3231_IOCTL_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+#include <linux/rtc.h>
+
+/**
+ * @defgroup Ioctl
+ * Binary interface of the character device. This header has no kernel-only
+ * dependencies and may be included by userspace programs.
+ */
+
+/**
+ * @addtogroup Ioctl
+ *
+ * @{
+ */
+
+/** Time and status of the RTC as returned by <tt>DS3231_IOC_RD_STATUS</tt> */
+struct ds3231_ioc_status
+{
+    struct rtc_time time; /**< Time of the RTC (<tt>tm_year</tt> counts from 1900, <tt>tm_mon</tt> from 0) */
+    __s16 temp; /**< Temperature of the RTC in 1/4 °C steps */
+    __s8 aging; /**< Aging offset register of the RTC */
+    __u8 osf; /**< Oscillator stop flag (1 if the oscillator was stopped) */
+    __u8 bsy; /**< Busy flag (1 while a temperature conversion is running) */
+    __u8 health; /**< Bus health of the chip (0 = ok, 1 = degraded, 2 = recovering, see <tt>retry_max</tt>) */
+    __u8 reserved[2];
+};
+
+/** Alarm as exchanged by <tt>DS3231_IOC_RD_ALARM</tt> and <tt>DS3231_IOC_SET_ALARM</tt> */
+struct ds3231_ioc_alarm
+{
+    __u8 alarm; /**< The alarm (1 or 2) */
+    __u8 enabled; /**< 1 if the alarm raises an interrupt when it fires */
+    __u8 pending; /**< 1 if the alarm fired and was not yet acknowledged (read only) */
+    __u8 reserved;
+    struct rtc_time time; /**< Day of the month, hour, minute and second (alarm 1 only) the alarm fires at; the rest is ignored */
+};
+
+/** Timer as registered by <tt>DS3231_IOC_ADD_TIMER</tt> */
+struct ds3231_ioc_timer
+{
+    __s64 expires; /**< Deadline in RTC seconds since the epoch */
+    __u64 cookie; /**< Returned by <tt>DS3231_IOC_RD_EXPIRED</tt> once the timer expired */
+};
+
+/** Timestamped temperature sample as returned by <tt>DS3231_IOC_RD_TEMP_HISTORY</tt> */
+struct ds3231_ioc_temp_sample
+{
+    __s64 time_ns; /**< <tt>CLOCK_REALTIME</tt> of the sample in nanoseconds */
+    __s16 temp; /**< Temperature in 1/4 °C steps */
+    __u8 reserved[6];
+};
+
+/** Buffer for <tt>DS3231_IOC_RD_TEMP_HISTORY</tt> */
+struct ds3231_ioc_temp_history
+{
+    __u32 count; /**< In: capacity of <tt>samples</tt>. Out: number of samples written */
+    __u32 reserved;
+    __u64 samples; /**< Userspace pointer to an array of <tt>struct ds3231_ioc_temp_sample</tt> */
+};
+
+/** States of the aging offset calibration (see <tt>struct ds3231_ioc_calib</tt>) */
+#define DS3231_CALIB_OFF 0 /**< Calibration is disabled */
+#define DS3231_CALIB_HOLD 1 /**< Waiting for the system clock to be synchronized or for square wave interrupts */
+#define DS3231_CALIB_TRACKING 2 /**< Tracking the offset between the RTC and <tt>CLOCK_REALTIME</tt> */
+
+/** State of the aging offset calibration as returned by <tt>DS3231_IOC_RD_CALIB</tt> */
+struct ds3231_ioc_calib
+{
+    __s64 offset_ns; /**< Last measured offset of <tt>CLOCK_REALTIME</tt> against the RTC in nanoseconds */
+    __s32 drift_ppb; /**< Estimated frequency error of the RTC in parts per billion (positive if the RTC runs fast) */
+    __u32 window_s; /**< Length of the current measurement window in seconds */
+    __u32 adjustments; /**< Number of times the aging offset was adjusted */
+    __s8 aging; /**< Current aging offset register */
+    __u8 state; /**< One of the <tt>DS3231_CALIB_*</tt> states */
+    __u8 valid; /**< 1 if <tt>drift_ppb</tt> holds an estimate */
+    __u8 reserved;
+};
+
+/** Result of <tt>DS3231_IOC_SYNC_TIME</tt> */
+struct ds3231_ioc_sync
+{
+    __s64 seconds; /**< Second of <tt>CLOCK_REALTIME</tt> the RTC was set to at its start */
+    __s64 error_ns; /**< Offset of the RTC's second boundary against the one of <tt>CLOCK_REALTIME</tt> in nanoseconds (positive if the RTC is late) */
+    __u32 latency_ns; /**< Measured bus latency the write was issued ahead of the boundary by */
+    __u32 write_ns; /**< Duration of the register write in nanoseconds */
+    __u8 measured; /**< 1 if <tt>error_ns</tt> was measured at the next square wave edge, 0 if it is estimated from the write */
+    __u8 reserved[7];
+};
+
+/** Value of <tt>magic</tt> in <tt>struct ds3231_time_record</tt> (not printable, so a record is never mistaken for text) */
+#define DS3231_TIME_RECORD_MAGIC 0xd3
+
+/** Binary record that sets the time of the RTC when written to the character device with a single <tt>write()</tt> */
+struct ds3231_time_record
+{
+    __u8 magic; /**< <tt>DS3231_TIME_RECORD_MAGIC</tt> */
+    __u8 reserved[7]; /**< Must be zero */
+    __s64 seconds; /**< Time in seconds since the epoch */
+};
+
+/**
+ * Read-only page with the latest state of the RTC, mapped with <tt>mmap()</tt> of one page at
+ * offset 0 of the character device. The driver updates it whenever it reads the chip and on
+ * every square wave edge. Readers retry while <tt>seq</tt> is odd or changed during the read:
+ *
+ * <pre>
+ * do {
+ *     seq = __atomic_load_n(&page->seq, __ATOMIC_ACQUIRE);
+ *     copy = *page;
+ *     __atomic_thread_fence(__ATOMIC_ACQUIRE);
+ * } while ((seq & 1) || seq != __atomic_load_n(&page->seq, __ATOMIC_RELAXED));
+ * </pre>
+ *
+ * The current RTC time is <tt>seconds</tt> plus the <tt>CLOCK_MONOTONIC</tt> time elapsed since
+ * <tt>anchor_ns</tt>, so no kernel entry is needed between updates.
+ */
+struct ds3231_time_page
+{
+    __u32 seq; /**< Sequence count, odd while the page is updated */
+    __u32 tick; /**< Number of square wave edges seen when the page was last updated */
+    __s64 seconds; /**< RTC time in seconds since the epoch at <tt>anchor_ns</tt> */
+    __s64 anchor_ns; /**< <tt>CLOCK_MONOTONIC</tt> time at which the RTC entered <tt>seconds</tt> */
+    __s16 temp; /**< Temperature in 1/4 °C steps */
+    __u8 valid; /**< 1 if <tt>seconds</tt> and <tt>anchor_ns</tt> hold a time, 0 until the chip was read or after the time was written */
+    __u8 osf; /**< Oscillator stop flag seen at the last status read */
+    __u8 edge; /**< 1 if <tt>anchor_ns</tt> is the timestamp of a square wave edge, 0 if it is estimated from reads */
+    __u8 reserved[3];
+};
+
+/** Sources of the fraction in <tt>struct ds3231_ioc_timestamp</tt> */
+#define DS3231_TS_NONE 0 /**< No fraction available, <tt>nsec</tt> is 0 */
+#define DS3231_TS_ESTIMATED 1 /**< Fraction relative to the second boundary estimated from reads of the chip */
+#define DS3231_TS_EDGE 2 /**< Fraction relative to the last square wave edge */
+
+/** RTC time with a sub-second fraction as returned by <tt>DS3231_IOC_RD_TIMESTAMP</tt> */
+struct ds3231_ioc_timestamp
+{
+    __s64 seconds; /**< RTC time in seconds since the epoch */
+    __u32 nsec; /**< Nanoseconds elapsed since the RTC entered <tt>seconds</tt> */
+    __u8 source; /**< One of the <tt>DS3231_TS_*</tt> sources of <tt>nsec</tt> */
+    __u8 reserved[3];
+};
+
+#define DS3231_IOC_MAGIC 'd'
+
+/** Reads the time of the RTC */
+#define DS3231_IOC_RD_TIME _IOR(DS3231_IOC_MAGIC, 0x01, struct rtc_time)
+/** Sets the time of the RTC */
+#define DS3231_IOC_SET_TIME _IOW(DS3231_IOC_MAGIC, 0x02, struct rtc_time)
+/** Reads time, status flags, temperature and aging offset of the RTC in one bus transaction */
+#define DS3231_IOC_RD_STATUS _IOR(DS3231_IOC_MAGIC, 0x03, struct ds3231_ioc_status)
+/** Reads the alarm selected by <tt>alarm</tt> */
+#define DS3231_IOC_RD_ALARM _IOWR(DS3231_IOC_MAGIC, 0x04, struct ds3231_ioc_alarm)
+/** Programs the alarm selected by <tt>alarm</tt>. An enabled alarm fires every month until disabled */
+#define DS3231_IOC_SET_ALARM _IOW(DS3231_IOC_MAGIC, 0x05, struct ds3231_ioc_alarm)
+/** Blocks until one of the alarms in the given mask (bit 0 = alarm 1, bit 1 = alarm 2) fires and returns the mask of alarms that fired */
+#define DS3231_IOC_WAIT_ALARM _IOWR(DS3231_IOC_MAGIC, 0x06, __u32)
+/** Registers a timer on this file handle. Any number of timers share alarm 1 */
+#define DS3231_IOC_ADD_TIMER _IOW(DS3231_IOC_MAGIC, 0x07, struct ds3231_ioc_timer)
+/** Removes the pending timers of this file handle with the given cookie */
+#define DS3231_IOC_DEL_TIMER _IOW(DS3231_IOC_MAGIC, 0x08, __u64)
+/** Returns the cookie of the oldest expired timer of this file handle or fails with <tt>EAGAIN</tt>. <tt>poll()</tt> reports <tt>POLLPRI</tt> while expired timers are available */
+#define DS3231_IOC_RD_EXPIRED _IOR(DS3231_IOC_MAGIC, 0x09, __u64)
+/** Copies the most recent samples of the temperature sampler, oldest first */
+#define DS3231_IOC_RD_TEMP_HISTORY _IOWR(DS3231_IOC_MAGIC, 0x0a, struct ds3231_ioc_temp_history)
+/** Starts a forced temperature conversion (or joins a running one) and returns immediately. <tt>poll()</tt> reports <tt>POLLPRI</tt> once it finished */
+#define DS3231_IOC_CONVERT_TEMP _IO(DS3231_IOC_MAGIC, 0x0b)
+/** Returns the temperature (1/4 °C steps) of the conversion started with <tt>DS3231_IOC_CONVERT_TEMP</tt>. Blocks until it finished unless the file is non-blocking (<tt>EAGAIN</tt>) */
+#define DS3231_IOC_RD_CONV_TEMP _IOR(DS3231_IOC_MAGIC, 0x0c, __s16)
+/** Reads the state and the current drift estimate of the aging offset calibration */
+#define DS3231_IOC_RD_CALIB _IOR(DS3231_IOC_MAGIC, 0x0d, struct ds3231_ioc_calib)
+/** Sets the RTC to <tt>CLOCK_REALTIME</tt> at the next second boundary and returns the achieved error. Blocks for up to two seconds */
+#define DS3231_IOC_SYNC_TIME _IOR(DS3231_IOC_MAGIC, 0x0e, struct ds3231_ioc_sync)
+/** Reads the time of the RTC with a sub-second fraction taken from the square wave edges */
+#define DS3231_IOC_RD_TIMESTAMP _IOR(DS3231_IOC_MAGIC, 0x0f, struct ds3231_ioc_timestamp)
+/** Returns the result of the last write of this non-blocking file handle (<tt>0</tt> or a negative error, which is cleared) or fails with <tt>EAGAIN</tt> while it is still being applied */
+#define DS3231_IOC_RD_WRITE_RESULT _IOR(DS3231_IOC_MAGIC, 0x10, __s32)
+/** @} */
+
+#endif
@@ -0,0 +1,198 @@
+/*******************************************************
+ * ( ) ds3231_hw.c     :: Hardware interfacing         *
+ * ( ) ds3231_health.c :: Bus error recovery           *
+ * ( ) ds3231_codec.c  :: Register conversion          *
+ * ( ) ds3231_emul.c   :: Emulated register model      *
+ * ( ) ds3231_sync.c   :: Second-aligned time setting  *
+ * ( ) ds3231_page.c   :: Shared time page             *
+ * (*) ds3231_irq.c    :: Interrupt handling           *
+ * ( ) ds3231_timer.c  :: Alarm timer multiplexing     *
+ * ( ) ds3231_temp.c   :: Temperature sampling         *
+ * ( ) ds3231_calib.c  :: Aging offset calibration     *
+ * ( ) ds3231_debug.c  :: Tracing and statistics       *
+ * ( ) ds3231_io.c     :: Character device interfacing *
+ * ( ) ds3231_rtc.c    :: RTC class interfacing        *
+ * ( ) ds3231_mod.c    :: Linux module handling        *
+ *******************************************************/
+#include "ds3231.h"
+
+/** GPIO the INT/SQW pin of the RTC is wired to (<tt>-1</tt> if it is not connected) */
+static int sqw_gpio = -1;
+module_param(sqw_gpio, int, 0444);
+MODULE_PARM_DESC(sqw_gpio, "GPIO connected to the INT/SQW pin of the RTC (-1 = not connected, chips with an interrupt from the device tree ignore it)");
+
+/** Set to register the 1 Hz square wave as PPS source (square wave mode only) */
+static bool pps;
+module_param(pps, bool, 0444);
+MODULE_PARM_DESC(pps, "Register the 1 Hz square wave on sqw_gpio as PPS source (requires CONFIG_PPS)");
+
+/**
+ * Primary handler of the INT/SQW interrupt. Runs in hard interrupt context and therefore
+ * never touches the I2C bus. In square wave mode it records the edge, feeds the PPS source
+ * and wakes up waiters; the threaded handler is only woken if an alarm is enabled and its
+ * flag has to be checked. In alarm mode every interrupt is an alarm and goes to the thread.
+ */
+static irqreturn_t ds3231_irq_handler(int irq, void *dev_id)
+{
+    ds3231_status_t *chip = dev_id;
+#if IS_ENABLED(CONFIG_PPS)
+    struct pps_event_time ts;
+
+    /* Capture the timestamp first, everything else only adds jitter */
+    pps_get_ts(&ts);
+    if (chip->pps != null) {
+        pps_event(chip->pps, &ts, PPS_CAPTUREASSERT, null);
+    }
+#endif
+
+    if (!chip->sqw) {
+        return IRQ_WAKE_THREAD;
+    }
+
+    ds3231_page_tick(chip, ktime_get());
+    wake_up_interruptible_all(&chip->tick_wait);
+    return READ_ONCE(chip->alarm_enabled) ? IRQ_WAKE_THREAD : IRQ_HANDLED;
+}
+
+
+/**
+ * Threaded handler of the INT/SQW interrupt. Reads and acknowledges the alarm flags and
+ * wakes up everyone waiting for the alarms that fired.
+ */
+static irqreturn_t ds3231_irq_thread(int irq, void *dev_id)
+{
+    ds3231_status_t *chip = dev_id;
+    u8 fired = 0;
+    int retval;
+
+    mutex_lock(&chip->lock);
+    retval = ds3231_ack_alarms(chip, &fired);
+    mutex_unlock(&chip->lock);
+
+    if (retval < 0) {
+        pr_err("ds3231: could not acknowledge alarms\n");
+        return IRQ_HANDLED;
+    }
+
+    if (fired & DS3231_MASK_A1F) {
+        WRITE_ONCE(chip->alarm_events[0], chip->alarm_events[0] + 1);
+        if (chip->timers_armed) {
+            ds3231_timer_run(chip);
+        } else if (chip->rtc != null) {
+            rtc_update_irq(chip->rtc, 1, RTC_AF | RTC_IRQF);
+        }
+    }
+
+    if (fired & DS3231_MASK_A2F) {
+        WRITE_ONCE(chip->alarm_events[1], chip->alarm_events[1] + 1);
+    }
+
+    if (fired) {
+        wake_up_interruptible_all(&chip->alarm_wait);
+    }
+
+    return IRQ_HANDLED;
+}
+
+
+/**
+ * Registers the square wave as PPS source if requested by the <tt>pps</tt> module parameter.
+ * Failing to do so is not fatal, the square wave interrupt works without it.
+ */
+static void ds3231_pps_init(ds3231_status_t *chip)
+{
+#if IS_ENABLED(CONFIG_PPS)
+    struct pps_source_info info = {
+        .name = "ds3231_drv",
+        .path = "",
+        .mode = PPS_CAPTUREASSERT | PPS_OFFSETASSERT | PPS_CANWAIT | PPS_TSFMT_TSPEC,
+        .owner = THIS_MODULE,
+        .dev = &chip->client->dev,
+    };
+#endif
+
+    if (!pps) {
+        return;
+    }
+
+#if IS_ENABLED(CONFIG_PPS)
+    chip->pps = pps_register_source(&info, PPS_CAPTUREASSERT | PPS_OFFSETASSERT);
+    if (chip->pps == null) {
+        pr_err("ds3231: could not register pps source\n");
+        return;
+    }
+
+    pr_info("ds3231: registered pps source %s\n", dev_name(chip->pps->dev));
+#else
+    pr_warn("ds3231: pps requested but the kernel was built without CONFIG_PPS\n");
+#endif
+}
+
+
+int ds3231_irq_init(ds3231_status_t *chip)
+{
+    struct i2c_client *client = chip->client;
+    int retval;
+
+    chip->irq = 0;
+    chip->ticking = 0;
+    chip->pps = null;
+
+    /* An interrupt described by the firmware takes precedence over the sqw_gpio parameter */
+    if (client->irq > 0) {
+        retval = client->irq;
+    } else if (sqw_gpio >= 0) {
+        retval = devm_gpio_request_one(&client->dev, sqw_gpio, GPIOF_IN, "ds3231_sqw");
+        if (retval < 0) {
+            pr_err("ds3231: could not request gpio %d\n", sqw_gpio);
+            return retval;
+        }
+
+        retval = gpio_to_irq(sqw_gpio);
+        if (retval < 0) {
+            pr_err("ds3231: gpio %d cannot be used as interrupt\n", sqw_gpio);
+            return retval;
+        }
+    } else {
+        return 0;
+    }
+
+    /*
+     * The seconds register of the RTC increments on the falling edge of the 1 Hz square wave.
+     * In alarm mode the active-low INT output also asserts with a falling edge.
+     */
+    chip->irq = retval;
+    retval = devm_request_threaded_irq(&client->dev, chip->irq, ds3231_irq_handler, ds3231_irq_thread,
+                                       IRQF_TRIGGER_FALLING | IRQF_ONESHOT, "ds3231_drv", chip);
+    if (retval < 0) {
+        pr_err("ds3231: could not request irq %d\n", chip->irq);
+        chip->irq = 0;
+        return retval;
+    }
+
+    pr_info("ds3231: %s %s interrupt on irq %d\n", dev_name(&client->dev), chip->sqw ? "square wave" : "alarm", chip->irq);
+    if (chip->sqw) {
+        chip->ticking = 1;
+        ds3231_pps_init(chip);
+    }
+    return 0;
+}
+
+
+void ds3231_irq_exit(ds3231_status_t *chip)
+{
+    if (chip->irq == 0) {
+        return;
+    }
+
+    /* The interrupt itself is released by devm after this; make sure it cannot use the PPS source any more */
+    disable_irq(chip->irq);
+    chip->ticking = 0;
+
+#if IS_ENABLED(CONFIG_PPS)
+    if (chip->pps != null) {
+        pps_unregister_source(chip->pps);
+        chip->pps = null;
+    }
+#endif
+}
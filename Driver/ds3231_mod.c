@@ -1,16 +1,26 @@
-/****************************************************
- * ( ) ds3231_hw.c  :: Hardware interfacing         *
- * ( ) ds3231_io.c  :: Character device interfacing *
- * (*) ds3231_mod.c :: Linux module handling        *
- ****************************************************/
+/*******************************************************
+ * ( ) ds3231_hw.c     :: Hardware interfacing         *
+ * ( ) ds3231_health.c :: Bus error recovery           *
+ * ( ) ds3231_codec.c  :: Register conversion          *
+ * ( ) ds3231_emul.c   :: Emulated register model      *
+ * ( ) ds3231_sync.c   :: Second-aligned time setting  *
+ * ( ) ds3231_page.c   :: Shared time page             *
+ * ( ) ds3231_irq.c    :: Interrupt handling           *
+ * ( ) ds3231_timer.c  :: Alarm timer multiplexing     *
+ * ( ) ds3231_temp.c   :: Temperature sampling         *
+ * ( ) ds3231_calib.c  :: Aging offset calibration     *
+ * ( ) ds3231_debug.c  :: Tracing and statistics       *
+ * ( ) ds3231_io.c     :: Character device interfacing *
+ * ( ) ds3231_rtc.c    :: RTC class interfacing        *
+ * (*) ds3231_mod.c    :: Linux module handling        *
+ *******************************************************/
 #include "ds3231.h"
 
-ds3231_status_t ds3231_status;
-
 /**
- * Registers the driver with the linux kernel and sets up the RTC.
- * It first sets up the RTC hardware and then registers the linux
- * character device.
+ * Registers the driver with the linux kernel and sets up the RTCs.
+ * It first registers the linux character device region and creates the
+ * debugfs directory, then the I2C driver, whose probe adds a character
+ * device for every chip.
  *
  * See <tt>ds3231_hw_init(void)</tt> and <tt>ds3231_io_init(void)</tt>
  * for more information about the setup procedure.
@@ -22,24 +32,27 @@ ds3231_status_t ds3231_status;
  * @brief Initializes the ds3231 RTC driver.
  */
 static int __init ds3231_drv_init(void) {
-    int rval = ds3231_hw_init();
+    int rval;
+
+    rval = ds3231_io_init();
     if (rval < 0) {
         return rval;
     }
 
-    rval = ds3231_io_init();
+    ds3231_debug_init();
+
+    rval = ds3231_hw_init();
     if (rval < 0) {
-      ds3231_hw_exit();
+      ds3231_debug_exit();
+      ds3231_io_exit();
     }
 
-    ds3231_status.drv_temp_test = 0;
-    atomic_set(&ds3231_status.drv_busy, UNLOCKED);
     return rval;
 }
 
 /**
- * Unregisters the driver from the linux kernel. First it unregisters the
- * character device, then removes the I2C driver and associated device.
+ * Unregisters the driver from the linux kernel. First it removes the I2C
+ * driver and associated devices, then unregisters the character device region.
  *
  * See <tt>ds3231_hw_exit(void)</tt> and <tt>ds3231_io_exit(void)</tt>
  * for more information about the unregister procedure.
@@ -51,8 +64,9 @@ static int __init ds3231_drv_init(void) {
  * @brief Uninitializes the ds3231 RTC driver.
  */
 static void __exit ds3231_drv_exit(void) {
-    ds3231_io_exit();
     ds3231_hw_exit();
+    ds3231_debug_exit();
+    ds3231_io_exit();
 }
 
 module_init(ds3231_drv_init);
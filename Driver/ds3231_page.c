@@ -0,0 +1,248 @@
+/*******************************************************
+ * ( ) ds3231_hw.c     :: Hardware interfacing         *
+ * ( ) ds3231_health.c :: Bus error recovery           *
+ * ( ) ds3231_codec.c  :: Register conversion          *
+ * ( ) ds3231_emul.c   :: Emulated register model      *
+ * ( ) ds3231_sync.c   :: Second-aligned time setting  *
+ * (*) ds3231_page.c   :: Shared time page             *
+ * ( ) ds3231_irq.c    :: Interrupt handling           *
+ * ( ) ds3231_timer.c  :: Alarm timer multiplexing     *
+ * ( ) ds3231_temp.c   :: Temperature sampling         *
+ * ( ) ds3231_calib.c  :: Aging offset calibration     *
+ * ( ) ds3231_debug.c  :: Tracing and statistics       *
+ * ( ) ds3231_io.c     :: Character device interfacing *
+ * ( ) ds3231_rtc.c    :: RTC class interfacing        *
+ * ( ) ds3231_mod.c    :: Linux module handling        *
+ *******************************************************/
+#include <linux/mm.h>
+#include <linux/gfp.h>
+
+#include "ds3231.h"
+
+/** Age of an edge anchor after which edges are considered missing (the next one is due after one second) */
+#define DS3231_EDGE_TIMEOUT_NS (3 * NSEC_PER_SEC / 2)
+
+/*
+ * The page lives in memory mapped by userspace, so it carries its own sequence count
+ * instead of a seqcount_t (whose layout depends on the kernel configuration). Writers are
+ * serialized by chip->page_lock; the protocol is the one of write_seqcount_begin/end.
+ */
+
+/** Starts an update of the shared page. Interrupts stay disabled until <tt>ds3231_page_end</tt>. */
+static struct ds3231_time_page *ds3231_page_begin(ds3231_status_t *chip, unsigned long *flags)
+{
+    struct ds3231_time_page *page = chip->page;
+
+    spin_lock_irqsave(&chip->page_lock, *flags);
+    WRITE_ONCE(page->seq, page->seq + 1);
+    smp_wmb();
+    return page;
+}
+
+
+/** Completes an update of the shared page */
+static void ds3231_page_end(ds3231_status_t *chip, unsigned long flags)
+{
+    struct ds3231_time_page *page = chip->page;
+
+    smp_wmb();
+    WRITE_ONCE(page->seq, page->seq + 1);
+    spin_unlock_irqrestore(&chip->page_lock, flags);
+}
+
+
+int ds3231_page_alloc(ds3231_status_t *chip)
+{
+    spin_lock_init(&chip->page_lock);
+    chip->page = (struct ds3231_time_page *)get_zeroed_page(GFP_KERNEL);
+    return chip->page == null ? -ENOMEM : 0;
+}
+
+
+void ds3231_page_free(ds3231_status_t *chip)
+{
+    free_page((unsigned long)chip->page);
+    chip->page = null;
+}
+
+
+void ds3231_page_set_time(ds3231_status_t *chip, time64_t secs, ktime_t start, ktime_t now)
+{
+    struct ds3231_time_page *page;
+    unsigned long flags;
+    s64 anchor, floor;
+
+    page = ds3231_page_begin(chip, &flags);
+
+    /* Same as the time cache; an edge anchor only survives reads it is consistent with */
+    anchor = page->anchor_ns;
+    floor = chip->page_floor;
+    if (!ds3231_anchor_refine(&anchor, &floor, page->valid, (secs - page->seconds) * NSEC_PER_SEC,
+                              ktime_to_ns(start), ktime_to_ns(now))) {
+        page->edge = 0;
+    }
+
+    page->seconds = secs;
+    page->anchor_ns = anchor;
+    chip->page_floor = floor;
+    chip->page_read_start = ktime_to_ns(start);
+    page->tick = READ_ONCE(chip->tick);
+    page->valid = 1;
+    ds3231_page_end(chip, flags);
+}
+
+
+void ds3231_page_tick(ds3231_status_t *chip, ktime_t edge)
+{
+    struct ds3231_time_page *page;
+    unsigned long flags;
+    s64 elapsed;
+
+    page = ds3231_page_begin(chip, &flags);
+    chip->tick_time = edge;
+    WRITE_ONCE(chip->tick, chip->tick + 1);
+
+    /* The seconds register increments on the falling edge, so the edge is the exact anchor */
+    if (page->valid) {
+        elapsed = ktime_to_ns(edge) - page->anchor_ns;
+        if (page->edge && elapsed > NSEC_PER_SEC / 2) {
+            /* From edge to edge: whole seconds apart, give or take the jitter of the interrupt */
+            page->seconds += div_s64(elapsed + NSEC_PER_SEC / 2, NSEC_PER_SEC);
+            page->anchor_ns = ktime_to_ns(edge);
+            chip->page_floor = page->anchor_ns - NSEC_PER_SEC;
+        } else if (!page->edge && ktime_to_ns(edge) > chip->page_read_start) {
+            /*
+             * The registers were latched after the read started, so the first edge after the start
+             * of the read begins seconds + 1, even if it came during the read or right after the
+             * anchor. The RTC entered seconds after page_floor and, unless it runs slow, at or before
+             * the anchor: count whole seconds from the floor when it is close to the boundary and
+             * round up from the anchor otherwise.
+             */
+            if (page->anchor_ns - chip->page_floor < NSEC_PER_SEC / 2) {
+                page->seconds += max_t(s64, 1, div_s64(ktime_to_ns(edge) - chip->page_floor, NSEC_PER_SEC));
+            } else {
+                page->seconds += elapsed <= 0 ? 1 : div_s64(elapsed + NSEC_PER_SEC - 1, NSEC_PER_SEC);
+            }
+            page->anchor_ns = ktime_to_ns(edge);
+            chip->page_floor = page->anchor_ns - NSEC_PER_SEC;
+            page->edge = 1;
+        }
+    }
+
+    page->tick = chip->tick;
+    ds3231_page_end(chip, flags);
+}
+
+
+ktime_t ds3231_tick_time(ds3231_status_t *chip, u32 *tick)
+{
+    unsigned long flags;
+    ktime_t edge;
+
+    spin_lock_irqsave(&chip->page_lock, flags);
+    edge = chip->tick_time;
+    *tick = chip->tick;
+    spin_unlock_irqrestore(&chip->page_lock, flags);
+
+    return edge;
+}
+
+
+void ds3231_page_set_status(ds3231_status_t *chip)
+{
+    struct ds3231_time_page *page;
+    unsigned long flags;
+
+    page = ds3231_page_begin(chip, &flags);
+    page->temp = chip->temp;
+    page->osf = chip->osf;
+    if (chip->osf) {
+        page->valid = 0;
+        page->edge = 0;
+    }
+    ds3231_page_end(chip, flags);
+}
+
+
+void ds3231_page_invalidate(ds3231_status_t *chip)
+{
+    struct ds3231_time_page *page;
+    unsigned long flags;
+
+    page = ds3231_page_begin(chip, &flags);
+    page->valid = 0;
+    page->edge = 0;
+    ds3231_page_end(chip, flags);
+}
+
+
+int ds3231_page_read_time(ds3231_status_t *chip, time64_t *secs, u32 *nsec)
+{
+    struct ds3231_time_page *page = chip->page;
+    unsigned long flags;
+    s64 elapsed;
+    int source;
+    s32 rem;
+
+    spin_lock_irqsave(&chip->page_lock, flags);
+    elapsed = ktime_to_ns(ktime_get()) - page->anchor_ns;
+    source = page->edge ? DS3231_TS_EDGE : DS3231_TS_ESTIMATED;
+    if (!page->valid || elapsed < 0) {
+        source = DS3231_TS_NONE;
+    } else if (source == DS3231_TS_EDGE && elapsed >= DS3231_EDGE_TIMEOUT_NS) {
+        /* Edges went missing, the anchor is only as good as an estimate now */
+        source = DS3231_TS_ESTIMATED;
+    }
+
+    if (source != DS3231_TS_NONE) {
+        *secs = page->seconds + div_s64_rem(elapsed, NSEC_PER_SEC, &rem);
+        *nsec = rem;
+    }
+    spin_unlock_irqrestore(&chip->page_lock, flags);
+
+    return source;
+}
+
+
+int ds3231_page_mmap(ds3231_status_t *chip, struct vm_area_struct *vma)
+{
+    if (vma->vm_pgoff != 0 || vma->vm_end - vma->vm_start != PAGE_SIZE) {
+        return -EINVAL;
+    }
+
+    if (vma->vm_flags & VM_WRITE) {
+        return -EPERM;
+    }
+
+    /* vm_insert_page takes its own reference, so the mapping may outlive the chip */
+    vma->vm_flags &= ~VM_MAYWRITE;
+    return vm_insert_page(vma, vma->vm_start, virt_to_page(chip->page));
+}
+
+
+int ds3231_get_timestamp(ds3231_status_t *chip, struct ds3231_ioc_timestamp *ts)
+{
+    ktime_t start = ktime_get();
+    ds3231_time_t time;
+    time64_t secs;
+    u32 nsec;
+    int retval;
+
+    memset(ts, 0, sizeof(*ts));
+    RETURN_IF_LTZ(ds3231_get_time(chip, &time), retval);
+    ts->seconds = ds3231_time_to_secs(&time);
+
+    /*
+     * The page only refines the seconds of the read with a fraction. It may be one second ahead
+     * if the RTC rolled over since the read started, anything else means it went stale.
+     */
+    retval = ds3231_page_read_time(chip, &secs, &nsec);
+    if (retval != DS3231_TS_NONE &&
+        (secs == ts->seconds || (secs == ts->seconds + 1 && nsec <= ktime_to_ns(ktime_sub(ktime_get(), start))))) {
+        ts->seconds = secs;
+        ts->nsec = nsec;
+        ts->source = retval;
+    }
+
+    return 0;
+}
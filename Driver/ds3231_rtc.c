@@ -0,0 +1,143 @@
+/*******************************************************
+ * ( ) ds3231_hw.c     :: Hardware interfacing         *
+ * ( ) ds3231_health.c :: Bus error recovery           *
+ * ( ) ds3231_codec.c  :: Register conversion          *
+ * ( ) ds3231_emul.c   :: Emulated register model      *
+ * ( ) ds3231_sync.c   :: Second-aligned time setting  *
+ * ( ) ds3231_page.c   :: Shared time page             *
+ * ( ) ds3231_irq.c    :: Interrupt handling           *
+ * ( ) ds3231_timer.c  :: Alarm timer multiplexing     *
+ * ( ) ds3231_temp.c   :: Temperature sampling         *
+ * ( ) ds3231_calib.c  :: Aging offset calibration     *
+ * ( ) ds3231_debug.c  :: Tracing and statistics       *
+ * ( ) ds3231_io.c     :: Character device interfacing *
+ * (*) ds3231_rtc.c    :: RTC class interfacing        *
+ * ( ) ds3231_mod.c    :: Linux module handling        *
+ *******************************************************/
+#include "ds3231.h"
+
+/**
+ * Reads the time of the RTC for the RTC class. Shares the time cache and read
+ * coalescing with the character device (see <tt>ds3231_get_time(ds3231_time_t*)</tt>).
+ */
+static int ds3231_rtc_read_time(struct device *dev, struct rtc_time *tm)
+{
+    ds3231_status_t *chip = dev_get_drvdata(dev);
+    ds3231_time_t time;
+    int retval;
+
+    retval = ds3231_get_time(chip, &time);
+    if (retval < 0) {
+        return retval;
+    }
+
+    ds3231_time_to_rtc(&time, tm);
+    return 0;
+}
+
+/** Sets the time of the RTC for the RTC class. */
+static int ds3231_rtc_set_time(struct device *dev, struct rtc_time *tm)
+{
+    ds3231_status_t *chip = dev_get_drvdata(dev);
+    ds3231_time_t time;
+    int retval;
+
+    retval = ds3231_rtc_to_time(tm, &time);
+    if (retval < 0) {
+        return retval;
+    }
+
+    mutex_lock(&chip->lock);
+    retval = ds3231_write_time(chip, &time);
+    mutex_unlock(&chip->lock);
+    return retval;
+}
+
+/**
+ * Reads alarm 1 for the RTC class. Only day, hour, minute and second are stored by
+ * the chip; the RTC core fills in month and year.
+ */
+static int ds3231_rtc_read_alarm(struct device *dev, struct rtc_wkalrm *alrm)
+{
+    ds3231_status_t *chip = dev_get_drvdata(dev);
+    ds3231_alarm_t alarm;
+    int retval;
+
+    mutex_lock(&chip->lock);
+    retval = ds3231_read_alarm(chip, 1, &alarm);
+    mutex_unlock(&chip->lock);
+    if (retval < 0) {
+        return retval;
+    }
+
+    alrm->time.tm_sec = alarm.second;
+    alrm->time.tm_min = alarm.minute;
+    alrm->time.tm_hour = alarm.hour;
+    alrm->time.tm_mday = alarm.day;
+    alrm->time.tm_mon = -1;
+    alrm->time.tm_year = -1;
+    alrm->time.tm_wday = -1;
+    alrm->time.tm_yday = -1;
+    alrm->time.tm_isdst = -1;
+    alrm->enabled = alarm.enabled;
+    alrm->pending = alarm.pending;
+    return 0;
+}
+
+/** Programs alarm 1 for the RTC class. Fails with <tt>-EBUSY</tt> while alarm 1 is owned by the timer queue. */
+static int ds3231_rtc_set_alarm(struct device *dev, struct rtc_wkalrm *alrm)
+{
+    ds3231_status_t *chip = dev_get_drvdata(dev);
+    ds3231_alarm_t alarm;
+    int retval;
+
+    alarm.second = alrm->time.tm_sec;
+    alarm.minute = alrm->time.tm_min;
+    alarm.hour = alrm->time.tm_hour;
+    alarm.day = alrm->time.tm_mday;
+    alarm.enabled = alrm->enabled;
+
+    mutex_lock(&chip->lock);
+    retval = chip->timers_armed ? ds3231_reject_busy(chip) : ds3231_write_alarm(chip, 1, &alarm);
+    mutex_unlock(&chip->lock);
+    return retval;
+}
+
+/** Enables or disables the interrupt of alarm 1 for the RTC class. Fails with <tt>-EBUSY</tt> while alarm 1 is owned by the timer queue. */
+static int ds3231_rtc_alarm_irq_enable(struct device *dev, unsigned int enabled)
+{
+    ds3231_status_t *chip = dev_get_drvdata(dev);
+    ds3231_alarm_t alarm;
+    int retval;
+
+    mutex_lock(&chip->lock);
+    retval = chip->timers_armed ? ds3231_reject_busy(chip) : ds3231_read_alarm(chip, 1, &alarm);
+    if (retval == 0 && alarm.enabled != !!enabled) {
+        alarm.enabled = !!enabled;
+        retval = ds3231_write_alarm(chip, 1, &alarm);
+    }
+    mutex_unlock(&chip->lock);
+    return retval;
+}
+
+/** RTC class operations */
+static const struct rtc_class_ops ds3231_rtc_ops = {
+    .read_time = ds3231_rtc_read_time,
+    .set_time = ds3231_rtc_set_time,
+    .read_alarm = ds3231_rtc_read_alarm,
+    .set_alarm = ds3231_rtc_set_alarm,
+    .alarm_irq_enable = ds3231_rtc_alarm_irq_enable,
+};
+
+
+int ds3231_rtc_init(ds3231_status_t *chip)
+{
+    chip->rtc = devm_rtc_device_register(&chip->client->dev, "ds3231_drv", &ds3231_rtc_ops, THIS_MODULE);
+    if (IS_ERR(chip->rtc)) {
+        pr_err("ds3231: rtc_device_register() failed\n");
+        return PTR_ERR(chip->rtc);
+    }
+
+    pr_info("ds3231: registered as %s\n", dev_name(&chip->rtc->dev));
+    return 0;
+}
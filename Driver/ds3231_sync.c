@@ -0,0 +1,170 @@
+/*******************************************************
+ * ( ) ds3231_hw.c     :: Hardware interfacing         *
+ * ( ) ds3231_health.c :: Bus error recovery           *
+ * ( ) ds3231_codec.c  :: Register conversion          *
+ * ( ) ds3231_emul.c   :: Emulated register model      *
+ * (*) ds3231_sync.c   :: Second-aligned time setting  *
+ * ( ) ds3231_page.c   :: Shared time page             *
+ * ( ) ds3231_irq.c    :: Interrupt handling           *
+ * ( ) ds3231_timer.c  :: Alarm timer multiplexing     *
+ * ( ) ds3231_temp.c   :: Temperature sampling         *
+ * ( ) ds3231_calib.c  :: Aging offset calibration     *
+ * ( ) ds3231_debug.c  :: Tracing and statistics       *
+ * ( ) ds3231_io.c     :: Character device interfacing *
+ * ( ) ds3231_rtc.c    :: RTC class interfacing        *
+ * ( ) ds3231_mod.c    :: Linux module handling        *
+ *******************************************************/
+#include <linux/hrtimer.h>
+#include <linux/sched.h>
+
+#include "ds3231.h"
+
+/** Number of reads the bus latency is measured with (the fastest one counts) */
+#define DS3231_SYNC_SAMPLES 3
+/** Time before the write the sleeper wakes up at to take the bus lock */
+#define DS3231_SYNC_LEAD_NS (2 * NSEC_PER_MSEC)
+/** How late the bus lock may be taken before the write is moved to the next second */
+#define DS3231_SYNC_LATE_NS (100 * NSEC_PER_USEC)
+/** Number of seconds the write is aimed at before giving up on a busy bus */
+#define DS3231_SYNC_ATTEMPTS 3
+
+/**
+ * Measures the bus latency up to the acknowledge of the first data byte. A single register
+ * read (address, register, address, data) takes about as long as the seconds byte of a block
+ * write (address, register, data) needs to be acknowledged, which is when the chip restarts
+ * its second. The caller has to hold <tt>chip->lock</tt>.
+ *
+ * @return The latency in nanoseconds or a kernel error code on failure.
+ */
+static s64 ds3231_sync_latency(ds3231_status_t *chip)
+{
+    s64 latency = S64_MAX, elapsed;
+    ktime_t start;
+    int i, retval;
+    u8 reg;
+
+    for (i = 0; i < DS3231_SYNC_SAMPLES; i++) {
+        start = ktime_get();
+        RETURN_IF_LTZ(ds3231_read_regs(chip, DS3231_REG_SECONDS, 1, &reg), retval);
+        elapsed = ktime_to_ns(ktime_sub(ktime_get(), start));
+        latency = min(latency, elapsed);
+    }
+
+    return latency;
+}
+
+
+/**
+ * Waits for the square wave edge following the write and measures the offset of the RTC's
+ * second boundary against <tt>CLOCK_REALTIME</tt> at it.
+ *
+ * @return <tt>0</tt> if the error was measured and <tt>-ETIMEDOUT</tt> or <tt>-ERANGE</tt> if no
+ * matching edge was seen.
+ */
+static int ds3231_sync_measure(ds3231_status_t *chip, u32 tick, time64_t secs, s64 *error_ns)
+{
+    s64 edge;
+    u32 seen;
+
+    if (wait_event_interruptible_timeout(chip->tick_wait, READ_ONCE(chip->tick) != tick, 2 * HZ) <= 0) {
+        return -ETIMEDOUT;
+    }
+
+    /* The next edge after the write is the start of second secs + 1 of the RTC */
+    edge = ktime_to_ns(ktime_mono_to_real(ds3231_tick_time(chip, &seen)));
+    if (seen != tick + 1) {
+        return -ERANGE;
+    }
+
+    *error_ns = edge - (secs + 1) * NSEC_PER_SEC;
+    return abs(*error_ns) < NSEC_PER_SEC / 2 ? 0 : -ERANGE;
+}
+
+
+int ds3231_sync_time(ds3231_status_t *chip, struct ds3231_ioc_sync *sync)
+{
+    u8 regs[DS3231_NUM_TIME_REGS];
+    ds3231_time_t time;
+    s64 latency, now, fire, error;
+    ktime_t expires, before, after;
+    time64_t secs;
+    u32 tick;
+    int attempt, retval;
+
+    memset(sync, 0, sizeof(*sync));
+
+    /* Restart a stopped oscillator first, like every other write of the time */
+    RETURN_IF_LTZ(mutex_lock_interruptible(&chip->lock), retval);
+    retval = ds3231_read_status(chip);
+    latency = retval < 0 ? retval : ds3231_sync_latency(chip);
+    mutex_unlock(&chip->lock);
+    if (latency < 0) {
+        return latency;
+    }
+
+    for (attempt = 0;; attempt++) {
+        /* Aim at the next second boundary that leaves enough time to wake up and take the bus */
+        now = ktime_to_ns(ktime_get_real());
+        secs = div_s64(now, NSEC_PER_SEC) + 1;
+        if (secs * NSEC_PER_SEC - latency - now < 2 * DS3231_SYNC_LEAD_NS) {
+            secs++;
+        }
+
+        if (secs < mktime64(2000, 1, 1, 0, 0, 0) || secs > mktime64(2199, 12, 31, 23, 59, 59)) {
+            return -EOVERFLOW;
+        }
+
+        /* Stage the registers, so only the transfer is left at the boundary */
+        ds3231_secs_to_time(secs, &time);
+        ds3231_encode_time(&time, regs);
+        fire = secs * NSEC_PER_SEC - latency;
+
+        /* Sleep on a CLOCK_REALTIME hrtimer until shortly before the write */
+        expires = ns_to_ktime(fire - DS3231_SYNC_LEAD_NS);
+        set_current_state(TASK_INTERRUPTIBLE);
+        if (schedule_hrtimeout_range_clock(&expires, 0, HRTIMER_MODE_ABS, CLOCK_REALTIME) != 0) {
+            return -EINTR;
+        }
+
+        /* Take the bus; another user may hold it past the boundary, which the write must not miss */
+        RETURN_IF_LTZ(mutex_lock_interruptible(&chip->lock), retval);
+        if (ktime_to_ns(ktime_get_real()) <= fire + DS3231_SYNC_LATE_NS) {
+            break;
+        }
+
+        mutex_unlock(&chip->lock);
+        if (attempt + 1 >= DS3231_SYNC_ATTEMPTS) {
+            pr_warn("ds3231: bus busy at %d second boundaries in a row, time not synchronized\n", DS3231_SYNC_ATTEMPTS);
+            return -EBUSY;
+        }
+    }
+
+    /* Spin for the rest, which the wake-up latency of the sleeper would blur */
+    while (ktime_to_ns(ktime_get_real()) < fire) {
+        cpu_relax();
+    }
+
+    before = ktime_get_real();
+    retval = ds3231_write_time_regs(chip, regs);
+    after = ktime_get_real();
+    tick = READ_ONCE(chip->tick);
+    mutex_unlock(&chip->lock);
+    if (retval < 0) {
+        return retval;
+    }
+
+    sync->seconds = secs;
+    sync->latency_ns = latency;
+    sync->write_ns = ktime_to_ns(ktime_sub(after, before));
+
+    /* The chip restarted its second about one latency after the transfer started */
+    sync->error_ns = ktime_to_ns(before) + latency - secs * NSEC_PER_SEC;
+
+    /* The square wave shows where the second boundary actually ended up */
+    if (chip->ticking && chip->sqw && ds3231_sync_measure(chip, tick, secs, &error) == 0) {
+        sync->error_ns = error;
+        sync->measured = 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,286 @@
+/*******************************************************
+ * ( ) ds3231_hw.c     :: Hardware interfacing         *
+ * ( ) ds3231_health.c :: Bus error recovery           *
+ * ( ) ds3231_codec.c  :: Register conversion          *
+ * ( ) ds3231_emul.c   :: Emulated register model      *
+ * ( ) ds3231_sync.c   :: Second-aligned time setting  *
+ * ( ) ds3231_page.c   :: Shared time page             *
+ * ( ) ds3231_irq.c    :: Interrupt handling           *
+ * ( ) ds3231_timer.c  :: Alarm timer multiplexing     *
+ * (*) ds3231_temp.c   :: Temperature sampling         *
+ * ( ) ds3231_calib.c  :: Aging offset calibration     *
+ * ( ) ds3231_debug.c  :: Tracing and statistics       *
+ * ( ) ds3231_io.c     :: Character device interfacing *
+ * ( ) ds3231_rtc.c    :: RTC class interfacing        *
+ * ( ) ds3231_mod.c    :: Linux module handling        *
+ *******************************************************/
+#include "ds3231.h"
+
+/** Period of the temperature sampler in milliseconds (<tt>0</tt> disables it) */
+static unsigned int temp_period_ms;
+
+/** Stores a new sampler period and starts, retimes or stops the sampler of every chip */
+static int ds3231_temp_period_set(const char *val, const struct kernel_param *kp)
+{
+    int retval;
+
+    RETURN_IF_LTZ(param_set_uint(val, kp), retval);
+    ds3231_io_for_each_chip(ds3231_temp_apply);
+    return 0;
+}
+
+static const struct kernel_param_ops ds3231_temp_period_ops = {
+    .set = ds3231_temp_period_set,
+    .get = param_get_uint,
+};
+
+module_param_cb(temp_period_ms, &ds3231_temp_period_ops, &temp_period_ms, 0644);
+MODULE_PARM_DESC(temp_period_ms, "Sample the temperature every temp_period_ms milliseconds into a history buffer (0 = off, takes effect immediately when changed at runtime)");
+
+/** Time until a forced conversion is first checked for completion (typical conversion time) */
+#define DS3231_CONV_DELAY_MS 125
+/** Interval at which a running conversion is checked afterwards */
+#define DS3231_CONV_POLL_MS 10
+/** Time after which a conversion that did not finish is given up */
+#define DS3231_CONV_TIMEOUT_MS 1000
+
+/** Appends a sample to the temperature history */
+static void ds3231_temp_record(ds3231_status_t *chip, s16 temp)
+{
+    ds3231_temp_sample_t *sample;
+
+    spin_lock(&chip->temp_lock);
+    sample = &chip->temp_history[chip->temp_head];
+    sample->time_ns = ktime_get_real_ns();
+    sample->temp = temp;
+    chip->temp_head = (chip->temp_head + 1) % DS3231_TEMP_HISTORY;
+    if (chip->temp_count < DS3231_TEMP_HISTORY) {
+        chip->temp_count++;
+    }
+    spin_unlock(&chip->temp_lock);
+}
+
+/**
+ * Reads the temperature registers, publishes the reading and appends it to the history.
+ * Re-schedules itself as long as <tt>temp_period_ms</tt> is not <tt>0</tt>.
+ */
+static void ds3231_temp_work(struct work_struct *work)
+{
+    ds3231_status_t *chip = container_of(to_delayed_work(work), ds3231_status_t, temp_work);
+    unsigned int period;
+    s16 temp;
+    int retval;
+
+    mutex_lock(&chip->lock);
+    retval = ds3231_read_temp(chip, &temp);
+    if (retval == 0 && !chip->drv_temp_test) {
+        chip->temp = temp;
+        ds3231_page_set_status(chip);
+    }
+
+    /* Decided under the lock, so ds3231_temp_apply sees either a running or a stopped sampler */
+    period = READ_ONCE(temp_period_ms);
+    if (period == 0 || chip->removed) {
+        /* Hand the temperature back to the register snapshots */
+        chip->temp_sampling = 0;
+    } else {
+        schedule_delayed_work(&chip->temp_work, msecs_to_jiffies(period));
+    }
+    mutex_unlock(&chip->lock);
+
+    if (retval < 0) {
+        pr_err("ds3231: could not sample temperature\n");
+    } else {
+        ds3231_temp_record(chip, temp);
+    }
+}
+
+
+/**
+ * Starts the forced conversion once BSY cleared, then checks whether it finished. Only holds
+ * the bus lock for a single access, so other users of the bus are not held up while the chip
+ * converts.
+ */
+static void ds3231_conv_work(struct work_struct *work)
+{
+    ds3231_status_t *chip = container_of(to_delayed_work(work), ds3231_status_t, conv_work);
+    int retval;
+    s16 temp;
+
+    mutex_lock(&chip->lock);
+    if (chip->conv_deferred) {
+        retval = ds3231_start_conversion(chip);
+        if (retval == 0) {
+            /* Now it is our conversion: time it from here */
+            chip->conv_deferred = 0;
+            chip->conv_start = ktime_get();
+            mutex_unlock(&chip->lock);
+            schedule_delayed_work(&chip->conv_work, msecs_to_jiffies(DS3231_CONV_DELAY_MS));
+            return;
+        }
+    } else {
+        retval = ds3231_read_conversion(chip, &temp);
+    }
+
+    /* -EBUSY: the chip's own conversion is still running, -EINPROGRESS: ours is */
+    if (retval == -EBUSY || retval == -EINPROGRESS) {
+        if (ktime_ms_delta(ktime_get(), chip->conv_start) < DS3231_CONV_TIMEOUT_MS && !chip->removed) {
+            mutex_unlock(&chip->lock);
+            schedule_delayed_work(&chip->conv_work, msecs_to_jiffies(DS3231_CONV_POLL_MS));
+            return;
+        }
+
+        retval = -ETIMEDOUT;
+    }
+
+    if (retval == 0) {
+        chip->conv_temp = temp;
+        if (!chip->drv_temp_test) {
+            chip->temp = temp;
+            ds3231_page_set_status(chip);
+        }
+    }
+
+    chip->conv_result = retval;
+    chip->conv_running = 0;
+    chip->conv_deferred = 0;
+    WRITE_ONCE(chip->conv_done, chip->conv_seq);
+    mutex_unlock(&chip->lock);
+
+    if (retval == 0) {
+        ds3231_temp_record(chip, temp);
+    } else {
+        pr_err("ds3231: temperature conversion failed\n");
+    }
+
+    wake_up_interruptible_all(&chip->conv_wait);
+}
+
+
+int ds3231_temp_convert(ds3231_status_t *chip, u32 *seq)
+{
+    int retval;
+
+    RETURN_IF_LTZ(mutex_lock_interruptible(&chip->lock), retval);
+    retval = ds3231_temp_convert_locked(chip, seq);
+    mutex_unlock(&chip->lock);
+    return retval;
+}
+
+
+int ds3231_temp_convert_locked(ds3231_status_t *chip, u32 *seq)
+{
+    int retval;
+
+    /* The work item must not be queued again once the chip is being torn down */
+    if (chip->removed) {
+        return -ENODEV;
+    }
+
+    /* Join a conversion that is already running */
+    if (chip->conv_running) {
+        *seq = chip->conv_seq;
+        return 0;
+    }
+
+    /* While the chip runs its own conversion, the work item sets CONV once BSY clears */
+    retval = ds3231_start_conversion(chip);
+    if (retval == 0 || retval == -EBUSY) {
+        chip->conv_running = 1;
+        chip->conv_deferred = retval == -EBUSY;
+        chip->conv_start = ktime_get();
+        *seq = ++chip->conv_seq;
+        schedule_delayed_work(&chip->conv_work,
+                              msecs_to_jiffies(chip->conv_deferred ? DS3231_CONV_POLL_MS : DS3231_CONV_DELAY_MS));
+        retval = 0;
+    }
+
+    return retval;
+}
+
+
+int ds3231_temp_conv_result(ds3231_status_t *chip, s16 *temp)
+{
+    int retval;
+
+    mutex_lock(&chip->lock);
+    retval = chip->conv_result;
+    *temp = chip->conv_temp;
+    mutex_unlock(&chip->lock);
+    return retval;
+}
+
+
+void ds3231_temp_init(ds3231_status_t *chip)
+{
+    INIT_DELAYED_WORK(&chip->temp_work, ds3231_temp_work);
+    INIT_DELAYED_WORK(&chip->conv_work, ds3231_conv_work);
+    chip->temp_head = 0;
+    chip->temp_count = 0;
+    chip->temp_sampling = 0;
+}
+
+
+void ds3231_temp_apply(ds3231_status_t *chip)
+{
+    unsigned int period = READ_ONCE(temp_period_ms);
+
+    mutex_lock(&chip->lock);
+    if (chip->removed) {
+        mutex_unlock(&chip->lock);
+        return;
+    }
+
+    if (period == 0) {
+        /* A sample that is already running sees the period and stops by itself */
+        if (chip->temp_sampling && cancel_delayed_work(&chip->temp_work)) {
+            chip->temp_sampling = 0;
+        }
+    } else if (!chip->temp_sampling) {
+        chip->temp_sampling = 1;
+        schedule_delayed_work(&chip->temp_work, 0);
+        pr_info("ds3231: %s samples the temperature every %u ms\n", dev_name(&chip->client->dev), period);
+    } else {
+        mod_delayed_work(system_wq, &chip->temp_work, msecs_to_jiffies(period));
+    }
+    mutex_unlock(&chip->lock);
+}
+
+
+void ds3231_temp_exit(ds3231_status_t *chip)
+{
+    cancel_delayed_work_sync(&chip->conv_work);
+    cancel_delayed_work_sync(&chip->temp_work);
+    chip->temp_sampling = 0;
+
+    /* Release waiters of a conversion whose check was cancelled */
+    mutex_lock(&chip->lock);
+    if (chip->conv_running) {
+        chip->conv_result = -ENODEV;
+        chip->conv_running = 0;
+        chip->conv_deferred = 0;
+        WRITE_ONCE(chip->conv_done, chip->conv_seq);
+    }
+    mutex_unlock(&chip->lock);
+    wake_up_interruptible_all(&chip->conv_wait);
+}
+
+
+unsigned int ds3231_temp_history(ds3231_status_t *chip, ds3231_temp_sample_t *samples, unsigned int count)
+{
+    unsigned int i, first;
+
+    spin_lock(&chip->temp_lock);
+    if (count > chip->temp_count) {
+        count = chip->temp_count;
+    }
+
+    /* Oldest first, skipping older samples that do not fit */
+    first = chip->temp_head + DS3231_TEMP_HISTORY - count;
+    for (i = 0; i < count; i++) {
+        samples[i] = chip->temp_history[(first + i) % DS3231_TEMP_HISTORY];
+    }
+    spin_unlock(&chip->temp_lock);
+
+    return count;
+}
@@ -0,0 +1,247 @@
+/*******************************************************
+ * ( ) ds3231_hw.c     :: Hardware interfacing         *
+ * ( ) ds3231_health.c :: Bus error recovery           *
+ * ( ) ds3231_codec.c  :: Register conversion          *
+ * ( ) ds3231_emul.c   :: Emulated register model      *
+ * ( ) ds3231_sync.c   :: Second-aligned time setting  *
+ * ( ) ds3231_page.c   :: Shared time page             *
+ * ( ) ds3231_irq.c    :: Interrupt handling           *
+ * (*) ds3231_timer.c  :: Alarm timer multiplexing     *
+ * ( ) ds3231_temp.c   :: Temperature sampling         *
+ * ( ) ds3231_calib.c  :: Aging offset calibration     *
+ * ( ) ds3231_debug.c  :: Tracing and statistics       *
+ * ( ) ds3231_io.c     :: Character device interfacing *
+ * ( ) ds3231_rtc.c    :: RTC class interfacing        *
+ * ( ) ds3231_mod.c    :: Linux module handling        *
+ *******************************************************/
+#include "ds3231.h"
+
+/** Upper bound of pending timers per file handle, so a single user cannot exhaust kernel memory */
+#define DS3231_MAX_TIMERS_PER_FILE 1024
+
+/**
+ * Moves all timers that expired at or before <tt>now</tt> to the expired list of their owner
+ * and wakes up the owners.
+ *
+ * @return <tt>1</tt> if any timer expired and <tt>0</tt> otherwise.
+ */
+static int ds3231_timer_expire(ds3231_status_t *chip, time64_t now)
+{
+    struct timerqueue_node *node;
+    ds3231_timer_t *timer;
+    int expired = 0;
+
+    while ((node = timerqueue_getnext(&chip->timers)) != null) {
+        if (ktime_after(node->expires, ktime_set(now, 0))) {
+            break;
+        }
+
+        timer = container_of(node, ds3231_timer_t, node);
+        timerqueue_del(&chip->timers, node);
+        list_move_tail(&timer->file_entry, &timer->owner->expired);
+        timer->owner->num_timers--;
+        expired = 1;
+    }
+
+    return expired;
+}
+
+/**
+ * Expires all due timers and programs alarm 1 with the earliest pending deadline, or disables
+ * it if no timer is left. Since alarm 1 only fires on an exact match, the time is read again
+ * after programming; a deadline that passed in the meantime is expired right away instead of
+ * waiting a month for the next match. The caller has to hold <tt>chip->lock</tt>.
+ *
+ * @return <tt>0</tt> on success and a kernel error code on failure.
+ */
+static int ds3231_timer_rearm(ds3231_status_t *chip)
+{
+    struct timerqueue_node *node;
+    ds3231_alarm_t alarm;
+    ds3231_time_t time, next;
+    int expired = 0;
+    int retval;
+
+    for (;;) {
+        retval = ds3231_read_time(chip, &time);
+        if (retval < 0) {
+            break;
+        }
+
+        expired |= ds3231_timer_expire(chip, ds3231_time_to_secs(&time));
+
+        node = timerqueue_getnext(&chip->timers);
+        if (node == null) {
+            if (chip->timers_armed) {
+                memset(&alarm, 0, sizeof(alarm));
+                alarm.day = 1;
+                retval = ds3231_write_alarm(chip, 1, &alarm);
+                chip->timers_armed = 0;
+            }
+            break;
+        }
+
+        ds3231_secs_to_time(ktime_divns(node->expires, NSEC_PER_SEC), &next);
+        alarm.second = next.second;
+        alarm.minute = next.minute;
+        alarm.hour = next.hour;
+        alarm.day = next.day;
+        alarm.enabled = 1;
+        retval = ds3231_write_alarm(chip, 1, &alarm);
+        if (retval < 0) {
+            break;
+        }
+        chip->timers_armed = 1;
+
+        /* Make sure the deadline did not pass while the alarm was programmed */
+        retval = ds3231_read_time(chip, &time);
+        if (retval < 0 || ds3231_time_to_secs(&time) < ktime_divns(node->expires, NSEC_PER_SEC)) {
+            break;
+        }
+    }
+
+    if (expired) {
+        wake_up_interruptible_all(&chip->alarm_wait);
+    }
+
+    return retval;
+}
+
+
+int ds3231_timer_add(ds3231_file_t *priv, time64_t expires, u64 cookie)
+{
+    ds3231_status_t *chip = priv->chip;
+    ds3231_timer_t *timer;
+    int retval;
+
+    if (chip->irq == 0) {
+        return -EOPNOTSUPP;
+    }
+
+    timer = kzalloc(sizeof(*timer), GFP_KERNEL);
+    if (timer == null) {
+        return -ENOMEM;
+    }
+
+    timerqueue_init(&timer->node);
+    timer->node.expires = ktime_set(expires, 0);
+    timer->owner = priv;
+    timer->cookie = cookie;
+
+    retval = mutex_lock_interruptible(&chip->lock);
+    if (retval < 0) {
+        kfree(timer);
+        return retval;
+    }
+
+    /* Alarm 1 is in use by the RTC class or DS3231_IOC_SET_ALARM */
+    if (!chip->timers_armed && (chip->alarm_enabled & DS3231_MASK_A1IE)) {
+        retval = ds3231_reject_busy(chip);
+        goto unlock;
+    }
+
+    if (priv->num_timers >= DS3231_MAX_TIMERS_PER_FILE) {
+        retval = -ENOSPC;
+        goto unlock;
+    }
+
+    list_add_tail(&timer->file_entry, &priv->timers);
+    priv->num_timers++;
+
+    /* Only a new earliest deadline needs the alarm to be reprogrammed */
+    if (timerqueue_add(&chip->timers, &timer->node)) {
+        retval = ds3231_timer_rearm(chip);
+    }
+
+    mutex_unlock(&chip->lock);
+    return retval;
+
+unlock:
+    mutex_unlock(&chip->lock);
+    kfree(timer);
+    return retval;
+}
+
+
+int ds3231_timer_del(ds3231_file_t *priv, u64 cookie)
+{
+    ds3231_status_t *chip = priv->chip;
+    ds3231_timer_t *timer, *tmp;
+    int removed = 0, rearm = 0;
+    int retval;
+
+    RETURN_IF_LTZ(mutex_lock_interruptible(&chip->lock), retval);
+
+    list_for_each_entry_safe(timer, tmp, &priv->timers, file_entry) {
+        if (timer->cookie != cookie) {
+            continue;
+        }
+
+        rearm |= timerqueue_getnext(&chip->timers) == &timer->node;
+        timerqueue_del(&chip->timers, &timer->node);
+        list_del(&timer->file_entry);
+        priv->num_timers--;
+        kfree(timer);
+        removed = 1;
+    }
+
+    retval = rearm ? ds3231_timer_rearm(chip) : 0;
+    mutex_unlock(&chip->lock);
+    return removed ? retval : -ENOENT;
+}
+
+
+int ds3231_timer_pop_expired(ds3231_file_t *priv, u64 *cookie)
+{
+    ds3231_status_t *chip = priv->chip;
+    ds3231_timer_t *timer;
+    int retval;
+
+    RETURN_IF_LTZ(mutex_lock_interruptible(&chip->lock), retval);
+
+    timer = list_first_entry_or_null(&priv->expired, ds3231_timer_t, file_entry);
+    if (timer != null) {
+        list_del(&timer->file_entry);
+        *cookie = timer->cookie;
+        kfree(timer);
+    }
+
+    mutex_unlock(&chip->lock);
+    return timer != null ? 0 : -EAGAIN;
+}
+
+
+void ds3231_timer_release(ds3231_file_t *priv)
+{
+    ds3231_status_t *chip = priv->chip;
+    ds3231_timer_t *timer, *tmp;
+    int rearm = 0;
+
+    mutex_lock(&chip->lock);
+
+    list_for_each_entry_safe(timer, tmp, &priv->timers, file_entry) {
+        rearm |= timerqueue_getnext(&chip->timers) == &timer->node;
+        timerqueue_del(&chip->timers, &timer->node);
+        kfree(timer);
+    }
+
+    list_for_each_entry_safe(timer, tmp, &priv->expired, file_entry) {
+        kfree(timer);
+    }
+
+    if (rearm) {
+        ds3231_timer_rearm(chip);
+    }
+
+    mutex_unlock(&chip->lock);
+}
+
+
+void ds3231_timer_run(ds3231_status_t *chip)
+{
+    mutex_lock(&chip->lock);
+    if (ds3231_timer_rearm(chip) < 0) {
+        pr_err("ds3231: could not re-arm alarm 1 for the timer queue\n");
+    }
+    mutex_unlock(&chip->lock);
+}
@@ -0,0 +1,88 @@
+/*
+ * Tracepoints of the ds3231 driver (ftrace/perf event group "ds3231"). Only included by
+ * ds3231_debug.c, after ds3231.h, which defines the DS3231_OP_* operations.
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM ds3231
+
+#if !defined(_DS3231_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _DS3231_TRACE_H
+
+#include <linux/device.h>
+#include <linux/tracepoint.h>
+
+/** Names of the DS3231_OP_* operations in the trace output */
+#define DS3231_OP_SYMBOLS                         \
+    {DS3231_OP_PROBE, "probe"},                   \
+    {DS3231_OP_READ_TIME, "read_time"},           \
+    {DS3231_OP_WRITE_TIME, "write_time"},         \
+    {DS3231_OP_READ_STATUS, "read_status"},       \
+    {DS3231_OP_READ_SNAPSHOT, "read_snapshot"},   \
+    {DS3231_OP_READ_TEMP, "read_temp"},           \
+    {DS3231_OP_GET_TIME, "get_time"}
+
+/** Emitted when an operation on the chip starts, before waiting for the bus */
+TRACE_EVENT(ds3231_op_begin,
+    TP_PROTO(struct device *dev, int op),
+    TP_ARGS(dev, op),
+
+    TP_STRUCT__entry(
+        __string(dev, dev_name(dev))
+        __field(int, op)
+    ),
+
+    TP_fast_assign(
+        __assign_str(dev, dev_name(dev));
+        __entry->op = op;
+    ),
+
+    TP_printk("%s %s", __get_str(dev), __print_symbolic(__entry->op, DS3231_OP_SYMBOLS))
+);
+
+/** Emitted when an operation on the chip finished, with its result and latency */
+TRACE_EVENT(ds3231_op_end,
+    TP_PROTO(struct device *dev, int op, int result, s64 latency_ns),
+    TP_ARGS(dev, op, result, latency_ns),
+
+    TP_STRUCT__entry(
+        __string(dev, dev_name(dev))
+        __field(int, op)
+        __field(int, result)
+        __field(s64, latency_ns)
+    ),
+
+    TP_fast_assign(
+        __assign_str(dev, dev_name(dev));
+        __entry->op = op;
+        __entry->result = result;
+        __entry->latency_ns = latency_ns;
+    ),
+
+    TP_printk("%s %s result=%d latency=%lld ns", __get_str(dev), __print_symbolic(__entry->op, DS3231_OP_SYMBOLS),
+              __entry->result, __entry->latency_ns)
+);
+
+/** Emitted when a request is rejected with -EBUSY */
+TRACE_EVENT(ds3231_busy,
+    TP_PROTO(struct device *dev),
+    TP_ARGS(dev),
+
+    TP_STRUCT__entry(
+        __string(dev, dev_name(dev))
+    ),
+
+    TP_fast_assign(
+        __assign_str(dev, dev_name(dev));
+    ),
+
+    TP_printk("%s", __get_str(dev))
+);
+
+#endif /* _DS3231_TRACE_H */
+
+/* Out-of-tree module: define_trace.h has to find this header next to the sources */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE ds3231_trace
+#include <trace/define_trace.h>